@@ -4,11 +4,74 @@
 #include <string>
 #include <utility>
 #include <queue>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <sstream>
+#include <unordered_map>
+#include <optional>
+#include <memory_resource>
+#include <string_view>
+#include <new>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <cstdlib>
+#include <cctype>
+#include <unordered_set>
+#include <map>
+#include <array>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+#include <ctime>
+#include <limits>
+#include <type_traits>
+#include <cerrno>
+#include <charconv>
+// Сборка с -DMESSENGER_USE_IO_URING (Linux, Boost 1.78+, линковка с -luring):
+// Asio переводит сокеты и таймеры с epoll на io_uring
+#ifdef MESSENGER_USE_IO_URING
+#include <boost/version.hpp>
+#if !defined(__linux__) || BOOST_VERSION < 107800
+#error "MESSENGER_USE_IO_URING requires Linux and Boost 1.78 or newer"
+#endif
+#define BOOST_ASIO_HAS_IO_URING 1
+#define BOOST_ASIO_DISABLE_EPOLL 1
+#endif
 #include <boost/beast/core.hpp>
 #include <boost/beast/websocket.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/asio.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/sync/file_lock.hpp>
+#include <boost/crc.hpp>
+// Сборка с -DMESSENGER_ENABLE_TLS (линковка с OpenSSL): второй порт с TLS 1.3
+#ifdef MESSENGER_ENABLE_TLS
+#include <boost/asio/ssl.hpp>
+#include <boost/beast/ssl.hpp>
+#endif
 #include <sqlite3.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
 
 namespace beast = boost::beast;
 namespace websocket = beast::websocket;
@@ -16,262 +79,5470 @@ namespace http = beast::http;
 namespace net = boost::asio;
 using tcp = net::ip::tcp;
 
+using http_request = http::request<http::string_body>;
+using http_response = http::response<http::string_body>;
+
+// Сессии параметризованы потоком: открытый TCP или TLS поверх него
+template<class Stream>
+constexpr bool is_tls_stream = false;
+#ifdef MESSENGER_ENABLE_TLS
+using tls_stream = beast::ssl_stream<beast::tcp_stream>;
+template<>
+constexpr bool is_tls_stream<tls_stream> = true;
+#endif
+
+#if defined(MESSENGER_USE_IO_URING)
+const char* io_backend = "io_uring";
+#elif defined(_WIN32)
+const char* io_backend = "iocp";
+#elif defined(__linux__)
+const char* io_backend = "epoll";
+#else
+const char* io_backend = "reactor";
+#endif
+
 class session; // Предварительное объявление
 std::set<std::shared_ptr<session>> clients;
+// Все WebSocket-сессии, включая ещё не вошедшие (для плавной остановки)
+std::unordered_set<session*> live_sessions;
+bool draining = false;
+// Вошедшие сессии по логину (у пользователя может быть несколько вкладок
+// и устройств): личное сообщение адресуется без обхода clients
+std::unordered_map<std::string, std::unordered_set<session*>> sessions_by_login;
+
+// Счётчики сервера, отдаются через GET /metrics
+struct server_metrics {
+    std::atomic<std::uint64_t> connections_accepted{ 0 };
+    std::atomic<std::uint64_t> startup_ms{ 0 };
+    std::atomic<std::uint64_t> first_accept_ms{ 0 };
+    std::atomic<std::uint64_t> config_reloads{ 0 };
+    std::atomic<std::uint64_t> config_reload_errors{ 0 };
+    std::atomic<std::uint64_t> websocket_sessions{ 0 };
+    std::atomic<std::uint64_t> http_requests{ 0 };
+    std::atomic<std::uint64_t> http_timeouts{ 0 };
+    std::atomic<std::uint64_t> static_hits{ 0 };
+    std::atomic<std::uint64_t> static_not_modified{ 0 };
+    std::atomic<std::uint64_t> messages_received{ 0 };
+    std::atomic<std::uint64_t> messages_sent{ 0 };
+    std::atomic<std::uint64_t> direct_messages{ 0 };
+    std::atomic<std::uint64_t> presence_notices{ 0 };
+    std::atomic<std::uint64_t> ephemeral_received{ 0 };
+    std::atomic<std::uint64_t> ephemeral_coalesced{ 0 };
+    std::atomic<std::uint64_t> ephemeral_dropped{ 0 };
+    std::atomic<std::uint64_t> read_marks_flushed{ 0 };
+    std::atomic<std::uint64_t> uploads_completed{ 0 };
+    std::atomic<std::uint64_t> uploads_failed{ 0 };
+    std::atomic<std::uint64_t> upload_bytes{ 0 };
+    std::atomic<std::uint64_t> uploads_deduplicated{ 0 };
+    std::atomic<std::uint64_t> blobs_collected{ 0 };
+    std::atomic<std::uint64_t> log_appends{ 0 };
+    std::atomic<std::uint64_t> shard_commits{ 0 };
+    std::atomic<std::uint64_t> shard_rows{ 0 };
+    std::atomic<std::uint64_t> shard_write_errors{ 0 };
+    std::atomic<std::uint64_t> archived_messages{ 0 };
+    std::atomic<std::uint64_t> archive_files{ 0 };
+    std::atomic<std::uint64_t> archive_raw_bytes{ 0 };
+    std::atomic<std::uint64_t> archive_compressed_bytes{ 0 };
+    std::atomic<std::uint64_t> archive_blocks_read{ 0 };
+    std::atomic<std::uint64_t> retention_rows_deleted{ 0 };
+    std::atomic<std::uint64_t> retention_pages_freed{ 0 };
+    std::atomic<std::uint64_t> retention_step_max_us{ 0 };
+    std::atomic<std::uint64_t> log_syncs{ 0 };
+    std::atomic<std::uint64_t> log_segments_created{ 0 };
+    std::atomic<std::uint64_t> arena_heap_allocations{ 0 };
+    std::atomic<std::uint64_t> arena_recycled_blocks{ 0 };
+    std::atomic<std::uint64_t> arena_cached_bytes{ 0 };
+    std::atomic<std::uint64_t> read_buffer_bytes_in_use{ 0 };
+    std::atomic<std::uint64_t> read_buffer_cached_bytes{ 0 };
+    std::atomic<std::uint64_t> connections_open{ 0 };
+    std::atomic<std::uint64_t> rejected_max_connections{ 0 };
+    std::atomic<std::uint64_t> rejected_per_ip{ 0 };
+    std::atomic<std::uint64_t> rejected_accept_rate{ 0 };
+    std::atomic<std::uint64_t> throttled_user{ 0 };
+    std::atomic<std::uint64_t> throttled_room{ 0 };
+    std::atomic<std::uint64_t> timers_pending{ 0 };
+    std::atomic<std::uint64_t> idle_timeouts{ 0 };
+    std::atomic<std::uint64_t> keepalive_pings{ 0 };
+    std::atomic<std::uint64_t> sessions_shed{ 0 };
+    std::atomic<std::uint64_t> resident_bytes{ 0 };
+    std::atomic<std::uint64_t> tls_handshakes{ 0 };
+    std::atomic<std::uint64_t> tls_resumed{ 0 };
+    std::atomic<std::uint64_t> tls_handshake_errors{ 0 };
+};
+server_metrics metrics;
+
+// Время запуска по этапам (в лог) и до первого принятого соединения (в /metrics)
+class startup_timer {
+public:
+    using clock = std::chrono::steady_clock;
+
+    void phase(const char* name) {
+        auto now = clock::now();
+        std::cout << "[startup] " << name << ": " << ms(now - last_) << " ms" << std::endl;
+        last_ = now;
+    }
+
+    // Порт открыт, дальше только цикл событий
+    void ready() {
+        metrics.startup_ms = ms(clock::now() - begin_);
+        std::cout << "[startup] ready to accept after " << metrics.startup_ms << " ms" << std::endl;
+    }
+
+    void accepted() {
+        if (first_accept_done_) {
+            return;
+        }
+        first_accept_done_ = true;
+        metrics.first_accept_ms = ms(clock::now() - begin_);
+        std::cout << "[startup] first connection accepted after " << metrics.first_accept_ms << " ms" << std::endl;
+    }
+
+private:
+    static std::uint64_t ms(clock::duration d) {
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(d).count());
+    }
+
+    clock::time_point begin_ = clock::now();
+    clock::time_point last_ = begin_;
+    bool first_accept_done_ = false;
+};
+startup_timer startup;
+
+// Глобальный список свободных блоков для арен сессий. Пул сессии берёт
+// у него крупные блоки, а при закрытии сессии блоки возвращаются сюда
+// и достаются следующим соединениям без обращения к куче.
+class block_recycler : public std::pmr::memory_resource {
+    static constexpr std::size_t max_cached_bytes = 64 * 1024 * 1024;
+    std::unordered_map<std::size_t, std::vector<void*>> free_;
+    std::size_t cached_bytes_ = 0;
+
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        auto it = free_.find(bytes);
+        if (alignment <= alignof(std::max_align_t) && it != free_.end() && !it->second.empty()) {
+            void* block = it->second.back();
+            it->second.pop_back();
+            cached_bytes_ -= bytes;
+            metrics.arena_cached_bytes = cached_bytes_;
+            ++metrics.arena_recycled_blocks;
+            return block;
+        }
+        ++metrics.arena_heap_allocations;
+        return ::operator new(bytes, std::align_val_t(std::max(alignment, alignof(std::max_align_t))));
+    }
+
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+        if (alignment <= alignof(std::max_align_t) && cached_bytes_ + bytes <= max_cached_bytes) {
+            free_[bytes].push_back(p);
+            cached_bytes_ += bytes;
+            metrics.arena_cached_bytes = cached_bytes_;
+            return;
+        }
+        ::operator delete(p, std::align_val_t(std::max(alignment, alignof(std::max_align_t))));
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+public:
+    // Отдать все свободные блоки куче (нехватка памяти)
+    void release_cached() {
+        for (auto& [bytes, blocks] : free_) {
+            for (void* p : blocks) {
+                ::operator delete(p, std::align_val_t(alignof(std::max_align_t)));
+            }
+            blocks.clear();
+        }
+        cached_bytes_ = 0;
+        metrics.arena_cached_bytes = 0;
+    }
+};
+block_recycler arena_blocks;
+
+// Буферы чтения по классам размеров (степени двойки от 256 байт до 64 КБ).
+// Буфер занят, только пока читается кадр, после разбора он возвращается сюда.
+class read_buffer_pool {
+public:
+    static constexpr std::size_t min_block = 256;
+    static constexpr std::size_t max_block = 64 * 1024;
+
+    void* allocate(std::size_t bytes) {
+        metrics.read_buffer_bytes_in_use += bytes;
+        std::size_t index = size_class(bytes);
+        if (index >= free_.size()) {
+            return ::operator new(bytes);
+        }
+        if (!free_[index].empty()) {
+            void* block = free_[index].back();
+            free_[index].pop_back();
+            metrics.read_buffer_cached_bytes -= min_block << index;
+            return block;
+        }
+        return ::operator new(min_block << index);
+    }
+
+    void deallocate(void* p, std::size_t bytes) noexcept {
+        metrics.read_buffer_bytes_in_use -= bytes;
+        std::size_t index = size_class(bytes);
+        if (index >= free_.size() || free_[index].size() >= max_cached_per_class) {
+            ::operator delete(p);
+            return;
+        }
+        free_[index].push_back(p);
+        metrics.read_buffer_cached_bytes += min_block << index;
+    }
+
+    // Отдать все свободные буферы куче (нехватка памяти)
+    void release_cached() {
+        for (auto& blocks : free_) {
+            for (void* p : blocks) {
+                ::operator delete(p);
+            }
+            blocks.clear();
+        }
+        metrics.read_buffer_cached_bytes = 0;
+    }
+
+private:
+    static constexpr std::size_t max_cached_per_class = 256;
+
+    static std::size_t size_class(std::size_t bytes) {
+        std::size_t index = 0;
+        while ((min_block << index) < bytes) {
+            ++index;
+        }
+        return index;
+    }
+
+    // 256, 512, 1K, ... 64K
+    std::vector<std::vector<void*>> free_ = std::vector<std::vector<void*>>(9);
+};
+read_buffer_pool read_buffers;
+
+template<class T>
+struct read_buffer_allocator {
+    using value_type = T;
+
+    read_buffer_allocator() = default;
+    template<class U>
+    read_buffer_allocator(const read_buffer_allocator<U>&) noexcept {
+    }
+
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(read_buffers.allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept {
+        read_buffers.deallocate(p, n * sizeof(T));
+    }
+
+    friend bool operator==(const read_buffer_allocator&, const read_buffer_allocator&) {
+        return true;
+    }
+    friend bool operator!=(const read_buffer_allocator&, const read_buffer_allocator&) {
+        return false;
+    }
+};
+
+// Маркерная корзина: rate маркеров в секунду, накапливается не больше burst
+class token_bucket {
+    double rate_;
+    double burst_;
+    double tokens_;
+    std::chrono::steady_clock::time_point last_;
+
+public:
+    token_bucket(double rate, double burst)
+        : rate_(rate), burst_(burst), tokens_(burst), last_(std::chrono::steady_clock::now()) {
+    }
+
+    bool try_consume(double tokens = 1.0) {
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed = now - last_;
+        last_ = now;
+        tokens_ = std::min(burst_, tokens_ + elapsed.count() * rate_);
+        if (tokens_ < tokens) {
+            return false;
+        }
+        tokens_ -= tokens;
+        return true;
+    }
+
+    // Вернуть маркеры, если действие всё-таки не состоялось
+    void put_back(double tokens = 1.0) {
+        tokens_ = std::min(burst_, tokens_ + tokens);
+    }
+
+    // Полна ли корзина сейчас: такая ничем не отличается от новой
+    bool full() const {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - last_;
+        return tokens_ + elapsed.count() * rate_ >= burst_;
+    }
+
+    // Новые лимиты без сброса накопленного (но не больше нового burst)
+    void retune(double rate, double burst) {
+        rate_ = rate;
+        burst_ = burst;
+        tokens_ = std::min(tokens_, burst_);
+    }
+};
+
+struct admission_limits {
+    std::size_t max_connections = 10000;
+    std::size_t max_connections_per_ip = 32;
+    double accept_rate = 200.0;  // новых соединений в секунду
+    double accept_burst = 500.0;
+};
+
+// Допуск новых соединений: общий лимит, лимит на IP и скорость accept.
+// Решение принимается сразу после accept, до разбора HTTP и рукопожатия.
+class admission_control {
+public:
+    enum class verdict { admitted, too_many_connections, too_many_from_ip, rate_limited };
+
+    // Занятое место; освобождается в деструкторе вместе с соединением
+    class slot {
+        admission_control* owner_ = nullptr;
+        std::string ip_;
+
+    public:
+        slot() = default;
+        slot(admission_control* owner, std::string ip) : owner_(owner), ip_(std::move(ip)) {
+        }
+        slot(slot&& other) noexcept : owner_(std::exchange(other.owner_, nullptr)), ip_(std::move(other.ip_)) {
+        }
+        slot& operator=(slot&& other) noexcept {
+            if (this != &other) {
+                reset();
+                owner_ = std::exchange(other.owner_, nullptr);
+                ip_ = std::move(other.ip_);
+            }
+            return *this;
+        }
+        ~slot() {
+            reset();
+        }
+
+    private:
+        void reset() {
+            if (owner_) {
+                owner_->release(ip_);
+                owner_ = nullptr;
+            }
+        }
+    };
+
+    explicit admission_control(admission_limits limits = {})
+        : limits_(limits), accept_bucket_(limits.accept_rate, limits.accept_burst) {
+    }
+
+    // Уже открытые соединения сверх нового лимита не закрываются
+    void set_limits(const admission_limits& limits) {
+        limits_ = limits;
+        accept_bucket_.retune(limits.accept_rate, limits.accept_burst);
+    }
+
+    verdict try_admit(const std::string& ip, slot& out) {
+        if (!accept_bucket_.try_consume()) {
+            ++metrics.rejected_accept_rate;
+            return verdict::rate_limited;
+        }
+        if (open_ >= limits_.max_connections) {
+            ++metrics.rejected_max_connections;
+            return verdict::too_many_connections;
+        }
+        // Запись на IP появляется только у допущенного соединения
+        auto it = per_ip_.find(ip);
+        if ((it == per_ip_.end() ? 0 : it->second) >= limits_.max_connections_per_ip) {
+            ++metrics.rejected_per_ip;
+            return verdict::too_many_from_ip;
+        }
+        ++per_ip_[ip];
+        ++open_;
+        metrics.connections_open = open_;
+        out = slot(this, ip);
+        return verdict::admitted;
+    }
+
+private:
+    void release(const std::string& ip) {
+        auto it = per_ip_.find(ip);
+        if (it != per_ip_.end() && --it->second == 0) {
+            per_ip_.erase(it);
+        }
+        --open_;
+        metrics.connections_open = open_;
+    }
+
+    admission_limits limits_;
+    token_bucket accept_bucket_;
+    std::size_t open_ = 0;
+    std::unordered_map<std::string, std::size_t> per_ip_;
+};
+admission_control admission;
+
+struct message_limits {
+    double user_rate = 5.0;     // сообщений в секунду на пользователя
+    double user_burst = 10.0;
+    double room_rate = 200.0;   // на весь чат
+    double room_burst = 400.0;
+};
+
+// Ограничение потока сообщений: корзина на логин (общая для всех вкладок
+// пользователя) и корзина на комнату. Пока комната одна - общий чат.
+class message_limiter {
+public:
+    enum class verdict { allowed, user_limited, room_limited };
+
+    explicit message_limiter(message_limits limits = {})
+        : limits_(limits), room_(limits.room_rate, limits.room_burst) {
+    }
+
+    void set_limits(const message_limits& limits) {
+        limits_ = limits;
+        room_.retune(limits.room_rate, limits.room_burst);
+        for (auto& [login, bucket] : users_) {
+            bucket.retune(limits.user_rate, limits.user_burst);
+        }
+    }
+
+    verdict check(const std::string& login) {
+        auto it = users_.find(login);
+        if (it == users_.end()) {
+            it = users_.emplace(login, token_bucket(limits_.user_rate, limits_.user_burst)).first;
+        }
+        if (!it->second.try_consume()) {
+            ++metrics.throttled_user;
+            return verdict::user_limited;
+        }
+        if (!room_.try_consume()) {
+            it->second.put_back();
+            ++metrics.throttled_room;
+            return verdict::room_limited;
+        }
+        return verdict::allowed;
+    }
+
+    // Полные корзины выбрасываются: иначе на каждый когда-либо вошедший
+    // логин оставалась бы своя. Зовётся из keepalive_sweeper раз за круг.
+    void prune() {
+        for (auto it = users_.begin(); it != users_.end();) {
+            it = it->second.full() ? users_.erase(it) : std::next(it);
+        }
+    }
+
+private:
+    message_limits limits_;
+    token_bucket room_;
+    std::unordered_map<std::string, token_bucket> users_;
+};
+message_limiter limiter;
+
+// Настройки сервера. Источники по возрастанию приоритета: значения ниже,
+// файл (строки key = value, # - комментарий), переменные MESSENGER_<KEY>
+// и аргументы --key=value. Файл: --config, MESSENGER_CONFIG или messenger.conf
+// рядом с базой из db_path в окружении или аргументах (его может и не быть).
+// По SIGHUP всё перечитывается заново, но применяются только настройки
+// с пометкой reloadable, остальные - после перезапуска. Читаются настройки
+// только в потоке цикла событий.
+struct server_config {
+    // Сеть, файлы и движок хранилища - только при запуске
+    std::string bind_address = "0.0.0.0";
+    unsigned short port = 8080;
+    unsigned short tls_port = 8443;
+    std::string db_path = "F:\\Projects\\Messenger\\messenger.db";
+    std::string web_root = "F:\\Projects\\Messenger\\code";
+    std::string upload_dir = "F:\\Projects\\Messenger\\uploads";
+    std::string log_dir = "F:\\Projects\\Messenger\\log";
+    std::string archive_dir = "F:\\Projects\\Messenger\\archive";
+    std::string shard_prefix = "F:\\Projects\\Messenger\\messages-";
+    std::string tls_cert = "F:\\Projects\\Messenger\\certs\\server.crt";
+    std::string tls_key = "F:\\Projects\\Messenger\\certs\\server.key";
+    std::string storage = "sqlite";
+    std::size_t shards = 4;          // потоков записи у движка sharded
+    long long archive_days = 0;
+    std::string db_journal_mode = "DELETE";
+
+    // SIGHUP
+    std::string db_synchronous = "FULL";
+    long long db_cache_kib = 2000;
+    std::chrono::milliseconds db_busy_timeout{ 5000 };
+    std::chrono::milliseconds handshake_timeout{ 10000 };
+    std::chrono::milliseconds idle_timeout{ 60000 };
+    std::chrono::milliseconds http_timeout{ 10000 };       // чтение запроса, TLS
+    std::chrono::milliseconds http_write_timeout{ 30000 }; // отправка ответа
+    // Окна, за которые копятся изменения перед отправкой или записью
+    std::chrono::milliseconds presence_window{ 500 };
+    std::chrono::milliseconds event_window{ 250 };
+    std::chrono::milliseconds receipts_window{ 2000 };
+    std::chrono::milliseconds log_sync_window{ 200 };
+    std::size_t ephemeral_backlog = 4;
+    std::uint64_t memory_limit_mb = 0;  // 0 - без ограничения
+    admission_limits admission;
+    message_limits messages;
+    long long retention_days = 0;
+    long long retention_max_rows = 0;
+};
+server_config config;
+
+class config_loader {
+public:
+    config_loader(int argc, char* argv[]) : args_(argv + 1, argv + argc) {
+        add_all();
+    }
+
+    // false - ошибка в файле или аргументах, out не тронут
+    bool load(server_config& out) const {
+        server_config next;
+        std::string path;
+        std::string db_path = next.db_path;
+        if (const char* env = std::getenv("MESSENGER_DB_PATH")) {
+            db_path = env;
+        }
+        bool explicit_path = false;
+        if (const char* env = std::getenv("MESSENGER_CONFIG")) {
+            path = env;
+            explicit_path = true;
+        }
+        std::vector<std::pair<std::string, std::string>> cli;
+        for (std::size_t i = 0; i < args_.size(); ++i) {
+            std::string_view arg = args_[i];
+            if (arg.substr(0, 2) != "--") {
+                std::cerr << "Unexpected argument: " << arg << std::endl;
+                return false;
+            }
+            arg.remove_prefix(2);
+            std::string key, value;
+            if (auto eq = arg.find('='); eq != std::string_view::npos) {
+                key = normalize(arg.substr(0, eq));
+                value = std::string(arg.substr(eq + 1));
+            }
+            else if (i + 1 < args_.size()) {
+                key = normalize(arg);
+                value = args_[++i];
+            }
+            else {
+                std::cerr << "Missing value for --" << arg << std::endl;
+                return false;
+            }
+            if (key == "config") {
+                path = value;
+                explicit_path = true;
+            }
+            else {
+                if (key == "db_path") {
+                    db_path = value;
+                }
+                cli.emplace_back(std::move(key), std::move(value));
+            }
+        }
+        if (!explicit_path) {
+            path = (std::filesystem::path(db_path).parent_path() / "messenger.conf").string();
+        }
+
+        std::ifstream file(path);
+        if (!file && explicit_path) {
+            std::cerr << "Cannot read config " << path << std::endl;
+            return false;
+        }
+        std::string line;
+        for (int number = 1; std::getline(file, line); ++number) {
+            std::string_view text = trim(line);
+            if (text.empty() || text[0] == '#') {
+                continue;
+            }
+            auto eq = text.find('=');
+            if (eq == std::string_view::npos) {
+                std::cerr << path << ":" << number << ": expected key = value" << std::endl;
+                return false;
+            }
+            if (!set(next, normalize(trim(text.substr(0, eq))), std::string(trim(text.substr(eq + 1))), path)) {
+                return false;
+            }
+        }
+        for (const auto& opt : options_) {
+            std::string env = "MESSENGER_" + opt.key;
+            std::transform(env.begin(), env.end(), env.begin(), [](unsigned char c) {
+                return static_cast<char>(std::toupper(c));
+                });
+            if (const char* value = std::getenv(env.c_str()); value && !set(next, opt.key, value, env)) {
+                return false;
+            }
+        }
+        for (const auto& [key, value] : cli) {
+            if (!set(next, key, value, "--" + key)) {
+                return false;
+            }
+        }
+        out = std::move(next);
+        return true;
+    }
+
+    // Переносит из next изменившиеся reloadable-настройки, об остальных предупреждает
+    void reload_into(server_config& current, server_config& next) const {
+        for (const auto& opt : options_) {
+            std::string before = opt.get(current);
+            std::string after = opt.get(next);
+            if (before == after) {
+                continue;
+            }
+            if (opt.reloadable) {
+                opt.set(current, after);
+                std::cout << "Config: " << opt.key << " " << before << " -> " << after << std::endl;
+            }
+            else {
+                std::cout << "Config: " << opt.key << " changed, takes effect after restart" << std::endl;
+            }
+        }
+    }
+
+private:
+    struct option {
+        std::string key;
+        bool reloadable;
+        std::function<bool(server_config&, const std::string&)> set;
+        std::function<std::string(server_config&)> get;
+    };
+
+    static std::string_view trim(std::string_view s) {
+        while (!s.empty() && std::isspace(static_cast<unsigned char>(s.front()))) {
+            s.remove_prefix(1);
+        }
+        while (!s.empty() && std::isspace(static_cast<unsigned char>(s.back()))) {
+            s.remove_suffix(1);
+        }
+        return s;
+    }
+
+    // --idle-timeout-ms и idle_timeout_ms - одно и то же
+    static std::string normalize(std::string_view key) {
+        std::string out(key);
+        for (auto& c : out) {
+            c = c == '-' ? '_' : static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        }
+        return out;
+    }
+
+    bool set(server_config& c, const std::string& key, const std::string& value, const std::string& source) const {
+        auto it = std::find_if(options_.begin(), options_.end(), [&](const option& opt) {
+            return opt.key == key;
+            });
+        if (it == options_.end()) {
+            std::cerr << source << ": unknown setting " << key << std::endl;
+            return false;
+        }
+        if (!it->set(c, value)) {
+            std::cerr << source << ": bad value for " << key << ": " << value << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    static bool parse(const std::string& text, std::string& out) {
+        out = text;
+        return true;
+    }
+    template <typename T>
+    static std::enable_if_t<std::is_integral_v<T>, bool> parse(const std::string& text, T& out) {
+        if (text.empty() || (std::is_unsigned_v<T> && text[0] == '-')) {
+            return false;
+        }
+        char* end = nullptr;
+        errno = 0;
+        long long value = std::strtoll(text.c_str(), &end, 10);
+        if (errno != 0 || *end != '\0' || value < 0
+            || static_cast<unsigned long long>(value) > static_cast<unsigned long long>(std::numeric_limits<T>::max())) {
+            return false;
+        }
+        out = static_cast<T>(value);
+        return true;
+    }
+    static bool parse(const std::string& text, double& out) {
+        char* end = nullptr;
+        double value = std::strtod(text.c_str(), &end);
+        if (text.empty() || *end != '\0' || !(value > 0)) {
+            return false;
+        }
+        out = value;
+        return true;
+    }
+    static bool parse(const std::string& text, std::chrono::milliseconds& out) {
+        long long ms;
+        if (!parse(text, ms)) {
+            return false;
+        }
+        out = std::chrono::milliseconds(ms);
+        return true;
+    }
+
+    static std::string format(const std::string& value) {
+        return value;
+    }
+    template <typename T>
+    static std::string format(const T& value) {
+        // Кратчайшая запись, которая читается обратно в то же число: ostream
+        // округлял бы до 6 знаков, и SIGHUP менял бы accept_rate и другие
+        if constexpr (std::is_floating_point_v<T>) {
+            char text[64];
+            auto end = std::to_chars(text, text + sizeof(text), value).ptr;
+            return std::string(text, end);
+        }
+        std::ostringstream out;
+        out << value;
+        return out.str();
+    }
+    static std::string format(const std::chrono::milliseconds& value) {
+        return std::to_string(value.count());
+    }
+
+    template <typename Field>
+    void add(const char* key, bool reloadable, Field field) {
+        options_.push_back({ key, reloadable,
+            [field](server_config& c, const std::string& text) {
+                return parse(text, field(c));
+            },
+            [field](server_config& c) {
+                return format(field(c));
+            } });
+    }
+
+    // Значение подставляется в PRAGMA, поэтому только из списка
+    template <typename Field>
+    void add_choice(const char* key, bool reloadable, Field field, std::vector<std::string> choices) {
+        options_.push_back({ key, reloadable,
+            [field, choices](server_config& c, const std::string& text) {
+                std::string value = text;
+                std::transform(value.begin(), value.end(), value.begin(), [](unsigned char ch) {
+                    return static_cast<char>(std::toupper(ch));
+                    });
+                if (std::find(choices.begin(), choices.end(), value) == choices.end()) {
+                    return false;
+                }
+                field(c) = value;
+                return true;
+            },
+            [field](server_config& c) {
+                return field(c);
+            } });
+    }
+
+    void add_all() {
+        add("bind_address", false, [](server_config& c) -> auto& { return c.bind_address; });
+        add("port", false, [](server_config& c) -> auto& { return c.port; });
+        add("tls_port", false, [](server_config& c) -> auto& { return c.tls_port; });
+        add("db_path", false, [](server_config& c) -> auto& { return c.db_path; });
+        add("web_root", false, [](server_config& c) -> auto& { return c.web_root; });
+        add("upload_dir", false, [](server_config& c) -> auto& { return c.upload_dir; });
+        add("log_dir", false, [](server_config& c) -> auto& { return c.log_dir; });
+        add("archive_dir", false, [](server_config& c) -> auto& { return c.archive_dir; });
+        add("shard_prefix", false, [](server_config& c) -> auto& { return c.shard_prefix; });
+        add("tls_cert", false, [](server_config& c) -> auto& { return c.tls_cert; });
+        add("tls_key", false, [](server_config& c) -> auto& { return c.tls_key; });
+        add("storage", false, [](server_config& c) -> auto& { return c.storage; });
+        add("shards", false, [](server_config& c) -> auto& { return c.shards; });
+        add("archive_days", false, [](server_config& c) -> auto& { return c.archive_days; });
+        add_choice("db_journal_mode", false, [](server_config& c) -> auto& { return c.db_journal_mode; },
+            { "DELETE", "TRUNCATE", "PERSIST", "MEMORY", "WAL", "OFF" });
+
+        add_choice("db_synchronous", true, [](server_config& c) -> auto& { return c.db_synchronous; },
+            { "OFF", "NORMAL", "FULL", "EXTRA" });
+        add("db_cache_kib", true, [](server_config& c) -> auto& { return c.db_cache_kib; });
+        add("db_busy_timeout_ms", true, [](server_config& c) -> auto& { return c.db_busy_timeout; });
+        add("handshake_timeout_ms", true, [](server_config& c) -> auto& { return c.handshake_timeout; });
+        add("idle_timeout_ms", true, [](server_config& c) -> auto& { return c.idle_timeout; });
+        add("http_timeout_ms", true, [](server_config& c) -> auto& { return c.http_timeout; });
+        add("http_write_timeout_ms", true, [](server_config& c) -> auto& { return c.http_write_timeout; });
+        add("presence_window_ms", true, [](server_config& c) -> auto& { return c.presence_window; });
+        add("event_window_ms", true, [](server_config& c) -> auto& { return c.event_window; });
+        add("receipts_window_ms", true, [](server_config& c) -> auto& { return c.receipts_window; });
+        add("log_sync_window_ms", true, [](server_config& c) -> auto& { return c.log_sync_window; });
+        add("ephemeral_backlog", true, [](server_config& c) -> auto& { return c.ephemeral_backlog; });
+        add("memory_limit_mb", true, [](server_config& c) -> auto& { return c.memory_limit_mb; });
+        add("max_connections", true, [](server_config& c) -> auto& { return c.admission.max_connections; });
+        add("max_connections_per_ip", true, [](server_config& c) -> auto& { return c.admission.max_connections_per_ip; });
+        add("accept_rate", true, [](server_config& c) -> auto& { return c.admission.accept_rate; });
+        add("accept_burst", true, [](server_config& c) -> auto& { return c.admission.accept_burst; });
+        add("user_message_rate", true, [](server_config& c) -> auto& { return c.messages.user_rate; });
+        add("user_message_burst", true, [](server_config& c) -> auto& { return c.messages.user_burst; });
+        add("room_message_rate", true, [](server_config& c) -> auto& { return c.messages.room_rate; });
+        add("room_message_burst", true, [](server_config& c) -> auto& { return c.messages.room_burst; });
+        add("retention_days", true, [](server_config& c) -> auto& { return c.retention_days; });
+        add("retention_max_rows", true, [](server_config& c) -> auto& { return c.retention_max_rows; });
+    }
+
+    std::vector<std::string> args_;
+    std::vector<option> options_;
+};
+
+// Хэшированное колесо таймеров: один steady_timer на весь сервер вместо
+// таймера на каждую сессию. Таймаут рукопожатия, простой, keepalive-пинги
+// и отложенное закрытие ставятся сюда. Корзины token_bucket таймеров не
+// требуют: они пополняются лениво при обращении.
+class timer_wheel {
+public:
+    using id_type = std::uint64_t;
+    using clock = std::chrono::steady_clock;
+
+    timer_wheel(std::chrono::milliseconds tick = std::chrono::milliseconds(25), std::size_t slots = 512)
+        : tick_(tick), slots_(slots) {
+    }
+
+    void start(net::io_context& ioc) {
+        timer_.emplace(ioc);
+        last_tick_ = clock::now();
+    }
+
+    // Точность - один тик; срабатывание не раньше чем через delay
+    id_type schedule(std::chrono::milliseconds delay, std::function<void()> fn) {
+        if (where_.empty() && !armed_) {
+            // Колесо стояло: начинаем отсчёт тиков заново
+            last_tick_ = clock::now();
+        }
+        auto ticks = static_cast<std::size_t>((delay + tick_ - std::chrono::milliseconds(1)) / tick_);
+        ticks = std::max<std::size_t>(ticks, 1);
+        std::size_t slot = (cursor_ + ticks) % slots_.size();
+        id_type id = ++next_id_;
+        slots_[slot].push_back(entry{ id, (ticks - 1) / slots_.size(), std::move(fn) });
+        where_[id] = slot;
+        metrics.timers_pending = where_.size();
+        arm();
+        return id;
+    }
+
+    // Вызывается до разрушения io_context
+    void stop() {
+        timer_.reset();
+        armed_ = false;
+        where_.clear();
+        for (auto& slot : slots_) {
+            slot.clear();
+        }
+    }
+
+    void cancel(id_type id) {
+        auto it = where_.find(id);
+        if (it == where_.end()) {
+            return;
+        }
+        auto& slot = slots_[it->second];
+        for (auto& e : slot) {
+            if (e.id == id) {
+                std::swap(e, slot.back());
+                slot.pop_back();
+                break;
+            }
+        }
+        where_.erase(it);
+        metrics.timers_pending = where_.size();
+    }
+
+private:
+    struct entry {
+        id_type id;
+        std::size_t rounds;     // сколько полных оборотов колеса ещё ждать
+        std::function<void()> fn;
+    };
+
+    void arm() {
+        if (armed_ || where_.empty() || !timer_) {
+            return;
+        }
+        armed_ = true;
+        timer_->expires_at(last_tick_ + tick_);
+        timer_->async_wait([this](beast::error_code ec) {
+            armed_ = false;
+            if (ec) {
+                return;
+            }
+            advance();
+            arm();
+            });
+    }
+
+    void advance() {
+        // Если цикл событий задержался, догоняем все пропущенные тики
+        auto now = clock::now();
+        if (where_.empty()) {
+            last_tick_ = now;
+            return;
+        }
+        while (last_tick_ + tick_ <= now) {
+            last_tick_ += tick_;
+            cursor_ = (cursor_ + 1) % slots_.size();
+            std::vector<std::function<void()>> due;
+            auto& slot = slots_[cursor_];
+            for (std::size_t i = 0; i < slot.size();) {
+                if (slot[i].rounds > 0) {
+                    --slot[i].rounds;
+                    ++i;
+                    continue;
+                }
+                where_.erase(slot[i].id);
+                due.push_back(std::move(slot[i].fn));
+                std::swap(slot[i], slot.back());
+                slot.pop_back();
+            }
+            metrics.timers_pending = where_.size();
+            // Обработчики могут ставить новые таймеры, поэтому вызываем после обхода
+            for (auto& fn : due) {
+                fn();
+            }
+        }
+    }
+
+    std::chrono::milliseconds tick_;
+    std::vector<std::vector<entry>> slots_;
+    std::unordered_map<id_type, std::size_t> where_;
+    std::size_t cursor_ = 0;
+    id_type next_id_ = 0;
+    clock::time_point last_tick_ = clock::now();
+    std::optional<net::steady_timer> timer_;
+    bool armed_ = false;
+};
+timer_wheel timers;
+
+// Присутствие: кто в сети и уведомления о входе/выходе. Изменения копятся
+// и рассылаются одним кадром раз в presence_window, поэтому волна из N
+// переподключений даёт O(N) исходящих сообщений, а не O(N^2).
+// Комната пока одна - общий чат, онлайн = есть хотя бы одна вошедшая сессия.
+class presence_tracker {
+public:
+    void joined(const std::string& login) {
+        note(login, true);
+    }
+    void left(const std::string& login) {
+        note(login, false);
+    }
+
+    // Для who: логины по алфавиту, из памяти
+    std::vector<std::string> online() const {
+        std::vector<std::string> logins;
+        logins.reserve(sessions_by_login.size());
+        for (const auto& [login, sessions] : sessions_by_login) {
+            logins.push_back(login);
+        }
+        std::sort(logins.begin(), logins.end());
+        return logins;
+    }
+
+    void flush();
+
+private:
+    void note(const std::string& login, bool online) {
+        if (draining) {
+            return;
+        }
+        auto [it, inserted] = pending_.try_emplace(login, online);
+        if (!inserted && it->second != online) {
+            // Вышел и вернулся в пределах окна - для остальных ничего не изменилось
+            pending_.erase(it);
+        }
+        if (!scheduled_) {
+            scheduled_ = true;
+            timers.schedule(config.presence_window, [this]() {
+                flush();
+                });
+        }
+    }
+
+    std::map<std::string, bool> pending_; // логин -> в сети после изменения
+    bool scheduled_ = false;
+};
+presence_tracker presence;
+
+// Keepalive всех WebSocket-сессий одним таймером вместо записи в колесе на
+// каждую сессию. Сессии разложены по slice_count срезам; за полупериод
+// idle_timeout каждый срез проверяется один раз, так что пинги уходят
+// равномерными пачками. На том же проходе проверяется память процесса
+// (RSS без кэшей свободных блоков): выше memory_limit_mb кэши и свободная куча
+// сначала возвращаются системе, и только если этого мало, закрываются дольше
+// всех молчащие сессии - невошедшие, а вошедшие лишь когда невошедших нет и
+// прошлый сброс память не снизил. Сброс идёт, пока память выше 90% лимита.
+class keepalive_sweeper {
+public:
+    static constexpr std::size_t slice_count = 16;
+    // Сколько сессий закрывается за один проход под нехваткой памяти
+    static constexpr std::size_t shed_batch = 64;
+
+    void start() {
+        schedule();
+    }
+
+    void add(session* s) {
+        slices_[next_slot_++ % slice_count].insert(s);
+    }
+    void remove(session* s) {
+        for (auto& slice : slices_) {
+            if (slice.erase(s)) {
+                return;
+            }
+        }
+    }
+
+private:
+    void schedule() {
+        timers.schedule(std::max<std::chrono::milliseconds>(config.idle_timeout / 2 / slice_count,
+            std::chrono::milliseconds(100)), [this]() {
+                sweep();
+            });
+    }
+
+    void sweep();
+    void shed_if_needed();
+
+    std::array<std::unordered_set<session*>, slice_count> slices_;
+    std::size_t next_slot_ = 0;
+    std::size_t next_slice_ = 0;
+    bool shedding_ = false;
+    std::uint64_t last_shed_ = 0;   // память после прошлого сброса, 0 - сброса ещё не было
+};
+keepalive_sweeper keepalive;
+
+// Резидентная память процесса в байтах, 0 - неизвестно
+std::uint64_t resident_memory() {
+#ifdef __linux__
+    std::ifstream statm("/proc/self/statm");
+    std::uint64_t total = 0, resident = 0;
+    if (statm >> total >> resident) {
+        return resident * static_cast<std::uint64_t>(::sysconf(_SC_PAGESIZE));
+    }
+#endif
+    return 0;
+}
+
+// Вложения: файлы принимаются по WebSocket кусками и лежат в config.upload_dir
+constexpr std::uint64_t max_upload_size = 100ull * 1024 * 1024;
+
+// Отметки о прочтении: на пару (пользователь, комната) хранится только id
+// последнего прочитанного сообщения. Отметки живут в памяти и пакетом
+// сбрасываются в read_marks, непрочитанное считается диапазоном messages.id.
+// Комнаты: "general" - общий чат, "@<логин>" - переписка с этим пользователем.
+class read_receipts {
+public:
+    void start(sqlite3* db) {
+        db_ = db;
+    }
+
+    // id последнего сохранённого сообщения: "прочитал всё" без знания id на клиенте
+    void note_message(std::int64_t id) {
+        latest_ = std::max(latest_, id);
+    }
+    std::int64_t latest() const {
+        return latest_;
+    }
+
+    // Подтягивает сохранённые отметки пользователя при первом входе
+    void load(const std::string& user) {
+        if (!loaded_.insert(user).second) {
+            return;
+        }
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db_, "SELECT room, last_read FROM read_marks WHERE user = ?;", -1, &stmt, nullptr) != SQLITE_OK) {
+            std::cerr << "SQL prepare error (read_marks): " << sqlite3_errmsg(db_) << std::endl;
+            return;
+        }
+        sqlite3_bind_text(stmt, 1, user.c_str(), -1, SQLITE_STATIC);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            std::string room = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+            auto& mark = marks_[key(user, room)];
+            mark = std::max<std::int64_t>(mark, sqlite3_column_int64(stmt, 1));
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    std::int64_t get(const std::string& user, std::string_view room) const {
+        auto it = marks_.find(key(user, room));
+        return it == marks_.end() ? 0 : it->second;
+    }
+
+    // Отметка только растёт; false - ничего не изменилось
+    bool mark(const std::string& user, std::string_view room, std::int64_t id) {
+        auto& mark = marks_[key(user, room)];
+        if (id <= mark) {
+            return false;
+        }
+        mark = id;
+        dirty_.insert(key(user, room));
+        if (!scheduled_) {
+            scheduled_ = true;
+            timers.schedule(config.receipts_window, [this]() {
+                flush();
+                });
+        }
+        return true;
+    }
+
+    // Все изменённые отметки - одной транзакцией
+    void flush() {
+        scheduled_ = false;
+        if (dirty_.empty()) {
+            return;
+        }
+        const char* sql = "INSERT INTO read_marks (user, room, last_read) VALUES (?, ?, ?) "
+            "ON CONFLICT (user, room) DO UPDATE SET last_read = MAX(last_read, excluded.last_read);";
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+            std::cerr << "SQL prepare error (read_marks): " << sqlite3_errmsg(db_) << std::endl;
+            return;
+        }
+        sqlite3_exec(db_, "BEGIN;", 0, 0, 0);
+        for (const auto& k : dirty_) {
+            auto split = k.find('\0');
+            sqlite3_bind_text(stmt, 1, k.data(), static_cast<int>(split), SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, k.data() + split + 1, static_cast<int>(k.size() - split - 1), SQLITE_STATIC);
+            sqlite3_bind_int64(stmt, 3, marks_[k]);
+            int rc = sqlite3_step(stmt);
+            if (rc != SQLITE_DONE) {
+                std::cerr << "SQL insert error (read_marks): " << sqlite3_errmsg(db_) << " (code: " << rc << ")" << std::endl;
+            }
+            sqlite3_reset(stmt);
+        }
+        sqlite3_exec(db_, "COMMIT;", 0, 0, 0);
+        sqlite3_finalize(stmt);
+        metrics.read_marks_flushed += dirty_.size();
+        dirty_.clear();
+    }
+
+private:
+    static std::string key(std::string_view user, std::string_view room) {
+        std::string k(user);
+        k += '\0';
+        k += room;
+        return k;
+    }
+
+    sqlite3* db_ = nullptr;
+    std::int64_t latest_ = 0;
+    std::unordered_map<std::string, std::int64_t> marks_; // "user\0room" -> last_read
+    std::unordered_set<std::string> dirty_;
+    std::unordered_set<std::string> loaded_;
+    bool scheduled_ = false;
+};
+read_receipts receipts;
+
+// Хранилище вложений по содержимому: файл лежит в uploads/ab/cd/<sha256>,
+// одинаковые файлы хранятся один раз. blobs.refs - сколько сообщений
+// ссылаются на файл; при нуле файл удаляется.
+class blob_store {
+public:
+    void start(sqlite3* db) {
+        db_ = db;
+    }
+
+    std::string path_for(const std::string& hash) const {
+        return (std::filesystem::path(config.upload_dir) / hash.substr(0, 2) / hash.substr(2, 2) / hash).string();
+    }
+
+    // Файл с таким хэшем и размером уже лежит в хранилище
+    bool exists(const std::string& hash, std::uint64_t size) {
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db_, "SELECT size FROM blobs WHERE hash = ? AND refs > 0;", -1, &stmt, nullptr) != SQLITE_OK) {
+            std::cerr << "SQL prepare error (blobs): " << sqlite3_errmsg(db_) << std::endl;
+            return false;
+        }
+        sqlite3_bind_text(stmt, 1, hash.c_str(), -1, SQLITE_STATIC);
+        bool found = sqlite3_step(stmt) == SQLITE_ROW
+            && static_cast<std::uint64_t>(sqlite3_column_int64(stmt, 0)) == size;
+        sqlite3_finalize(stmt);
+        std::error_code ec;
+        return found && std::filesystem::exists(path_for(hash), ec);
+    }
+
+    bool add_ref(const std::string& hash, std::uint64_t size) {
+        const char* sql = "INSERT INTO blobs (hash, size, refs) VALUES (?, ?, 1) "
+            "ON CONFLICT (hash) DO UPDATE SET refs = refs + 1;";
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+            std::cerr << "SQL prepare error (blobs): " << sqlite3_errmsg(db_) << std::endl;
+            return false;
+        }
+        sqlite3_bind_text(stmt, 1, hash.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(size));
+        int rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE) {
+            std::cerr << "SQL insert error (blobs): " << sqlite3_errmsg(db_) << " (code: " << rc << ")" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Сообщение со ссылкой на файл удалено; сам файл удалит collect()
+    void release(const std::string& hash) {
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db_, "UPDATE blobs SET refs = refs - 1 WHERE hash = ?;", -1, &stmt, nullptr) != SQLITE_OK) {
+            std::cerr << "SQL prepare error (blobs): " << sqlite3_errmsg(db_) << std::endl;
+            return;
+        }
+        sqlite3_bind_text(stmt, 1, hash.c_str(), -1, SQLITE_STATIC);
+        sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+    }
+
+    // Удаляет файлы, на которые больше никто не ссылается
+    std::size_t collect() {
+        std::vector<std::string> unused;
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db_, "SELECT hash FROM blobs WHERE refs <= 0;", -1, &stmt, nullptr) != SQLITE_OK) {
+            std::cerr << "SQL prepare error (blobs): " << sqlite3_errmsg(db_) << std::endl;
+            return 0;
+        }
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            unused.emplace_back(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
+        }
+        sqlite3_finalize(stmt);
+        for (const auto& hash : unused) {
+            std::error_code ec;
+            std::filesystem::remove(path_for(hash), ec);
+        }
+        sqlite3_exec(db_, "DELETE FROM blobs WHERE refs <= 0;", 0, 0, 0);
+        metrics.blobs_collected += unused.size();
+        return unused.size();
+    }
+
+private:
+    sqlite3* db_ = nullptr;
+};
+blob_store blobs;
+
+// Учётные записи. Движок выбирается вместе с хранилищем сообщений:
+// SQLite, в памяти (тесты, бенчмарки) или пустой (нагрузочные тесты без I/O).
+class user_store {
+public:
+    enum class add_result { created, exists, failed };
+    enum class check_result { ok, wrong_password, not_found };
+
+    virtual ~user_store() = default;
+    virtual add_result add(std::string_view login, const std::string& password_hash) = 0;
+    virtual check_result check(std::string_view login, const std::string& password_hash) = 0;
+    virtual bool exists(std::string_view login) = 0;
+};
+
+class sqlite_user_store : public user_store {
+public:
+    explicit sqlite_user_store(sqlite3* db) : db_(db) {
+    }
+
+    add_result add(std::string_view login, const std::string& password_hash) override {
+        std::string sql = "INSERT INTO users (login, password) VALUES (?, ?);";
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+            std::cerr << "SQL prepare error: " << sqlite3_errmsg(db_) << std::endl;
+            return add_result::failed;
+        }
+        sqlite3_bind_text(stmt, 1, login.data(), static_cast<int>(login.size()), SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, password_hash.c_str(), -1, SQLITE_STATIC);
+        int rc = sqlite3_step(stmt);
+        if (rc != SQLITE_DONE) {
+            std::string err_msg = sqlite3_errmsg(db_);
+            std::cerr << "SQL insert error: " << err_msg << " (code: " << rc << ")" << std::endl;
+            sqlite3_finalize(stmt);
+            return rc == SQLITE_CONSTRAINT ? add_result::exists : add_result::failed;
+        }
+        sqlite3_finalize(stmt);
+        return add_result::created;
+    }
+
+    check_result check(std::string_view login, const std::string& password_hash) override {
+        std::string sql = "SELECT password FROM users WHERE login = ?;";
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+            std::cerr << "SQL prepare error: " << sqlite3_errmsg(db_) << std::endl;
+            return check_result::not_found;
+        }
+        sqlite3_bind_text(stmt, 1, login.data(), static_cast<int>(login.size()), SQLITE_STATIC);
+        auto result = check_result::not_found;
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            std::string stored_password = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+            result = stored_password == password_hash ? check_result::ok : check_result::wrong_password;
+        }
+        sqlite3_finalize(stmt);
+        return result;
+    }
+
+    bool exists(std::string_view login) override {
+        std::string sql = "SELECT 1 FROM users WHERE login = ?;";
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+            std::cerr << "SQL prepare error: " << sqlite3_errmsg(db_) << std::endl;
+            return false;
+        }
+        sqlite3_bind_text(stmt, 1, login.data(), static_cast<int>(login.size()), SQLITE_STATIC);
+        bool found = sqlite3_step(stmt) == SQLITE_ROW;
+        sqlite3_finalize(stmt);
+        return found;
+    }
+
+private:
+    sqlite3* db_;
+};
+
+class memory_user_store : public user_store {
+public:
+    add_result add(std::string_view login, const std::string& password_hash) override {
+        return passwords_.try_emplace(std::string(login), password_hash).second ? add_result::created : add_result::exists;
+    }
+
+    check_result check(std::string_view login, const std::string& password_hash) override {
+        auto it = passwords_.find(std::string(login));
+        if (it == passwords_.end()) {
+            return check_result::not_found;
+        }
+        return it->second == password_hash ? check_result::ok : check_result::wrong_password;
+    }
+
+    bool exists(std::string_view login) override {
+        return passwords_.count(std::string(login)) > 0;
+    }
+
+private:
+    std::unordered_map<std::string, std::string> passwords_; // логин -> хэш пароля
+};
+
+// Любой логин существует и входит с любым паролем
+class null_user_store : public user_store {
+public:
+    add_result add(std::string_view, const std::string&) override {
+        return add_result::created;
+    }
+    check_result check(std::string_view, const std::string&) override {
+        return check_result::ok;
+    }
+    bool exists(std::string_view) override {
+        return true;
+    }
+};
+
+std::unique_ptr<user_store> accounts;
+
+// Сообщение в хранилище; recipient пуст у сообщений общего чата
+struct stored_message {
+    std::int64_t id = 0;
+    std::string user;
+    std::string content;
+    std::string type; // text, dm, file
+    std::string recipient;
+    std::string file_path;
+    std::string timestamp; // "YYYY-MM-DD HH:MM:SS", UTC
+};
+
+// Формат timestamp - как CURRENT_TIMESTAMP в SQLite, строки сравнимы
+std::string utc_timestamp(std::time_t time) {
+    char stamp[32];
+    std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", std::gmtime(&time));
+    return stamp;
+}
+
+// Сколько хранить сообщения. Комнаты - общий чат и каждое направление
+// личной переписки (от user к recipient).
+struct retention_policy {
+    std::chrono::seconds max_age{ 0 }; // 0 - без ограничения
+    std::int64_t max_rows = 0;         // на комнату, 0 - без ограничения
+    // Граница max_rows общего чата, посчитанная снаружи (общий чат разложен
+    // по шардам): удалить его сообщения с id <= general_through, 0 - ничего
+    std::optional<std::int64_t> general_through;
+
+    bool enabled() const {
+        return max_age.count() > 0 || max_rows > 0;
+    }
+};
+
+// Хранилище сообщений. Движок выбирается при запуске: SQLite (по умолчанию),
+// сегментный журнал, память или пустой.
+class message_store {
+public:
+    virtual ~message_store() = default;
+    virtual const char* name() const = 0;
+    // Заполняет m.id; false - сообщение не сохранено
+    virtual bool append(stored_message& m) = 0;
+    virtual std::int64_t latest_id() = 0;
+    virtual std::optional<stored_message> get(std::int64_t id) = 0;
+    // Общий чат, id < before, новые первыми
+    virtual std::vector<stored_message> history(std::int64_t before, int limit) = 0;
+    // Общий чат, подстрока без учёта регистра (ASCII), новые первыми
+    virtual std::vector<stored_message> search(const std::string& text, int limit) = 0;
+    // Личная переписка a и b, новые первыми
+    virtual std::vector<stored_message> conversation(const std::string& a, const std::string& b, int limit) = 0;
+    virtual std::int64_t count_public_after(std::int64_t after) = 0;
+    // Непрочитанные личные сообщения user по отправителям; mark(peer) - отметка о прочтении
+    virtual std::vector<std::pair<std::string, std::int64_t>> unread_direct(const std::string& user,
+        const std::function<std::int64_t(const std::string&)>& mark) = 0;
+    // Дописать на диск всё, что ещё в буферах
+    virtual void sync() {
+    }
+    // Соединение SQLite, в котором лежат сообщения (nullptr - не в SQLite):
+    // запись в ту же базу можно объединить с сообщением одной транзакцией
+    virtual sqlite3* connection() const {
+        return nullptr;
+    }
+    // Шаг очистки по политике: удаляет порцию около batch сообщений, пути файлов
+    // удалённых вложений добавляет в files. 0 - в этом цикле удалять больше нечего.
+    virtual std::size_t expire(const retention_policy&, std::size_t, std::vector<std::string>&) {
+        return 0;
+    }
+    // Вернуть освободившееся место файловой системе, не больше pages страниц за вызов.
+    // Возвращает число освобождённых страниц, 0 - возвращать нечего.
+    virtual std::int64_t compact(int) {
+        return 0;
+    }
+    // expire/compact выполняются в фоне и ещё не закончены: 0 от них не значит
+    // "работы нет", звать снова после паузы
+    virtual bool maintenance_pending() {
+        return false;
+    }
+    // Для переноса в архив: сообщения с id > after старше timestamp, по возрастанию id
+    virtual std::vector<stored_message> oldest(std::int64_t, const std::string&, int) {
+        return {};
+    }
+    // Удаляет порцию сообщений с id <= up_to, возвращает сколько удалено
+    virtual std::size_t remove_through(std::int64_t, std::size_t) {
+        return 0;
+    }
+};
+
+class sqlite_message_store : public message_store {
+public:
+    explicit sqlite_message_store(sqlite3* db) : db_(db) {
+    }
+
+    const char* name() const override {
+        return "sqlite";
+    }
+
+    sqlite3* connection() const override {
+        return db_;
+    }
+
+    bool append(stored_message& m) override {
+        std::string sql = "INSERT INTO messages (user, content, type, recipient, file_path) VALUES (?, ?, ?, ?, ?);";
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+            std::cerr << "SQL prepare error (messages): " << sqlite3_errmsg(db_) << std::endl;
+            return false;
+        }
+        auto bind_optional = [stmt](int i, const std::string& value) {
+            if (value.empty()) {
+                sqlite3_bind_null(stmt, i);
+            }
+            else {
+                sqlite3_bind_text(stmt, i, value.c_str(), static_cast<int>(value.size()), SQLITE_STATIC);
+            }
+        };
+        sqlite3_bind_text(stmt, 1, m.user.c_str(), static_cast<int>(m.user.size()), SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, m.content.c_str(), static_cast<int>(m.content.size()), SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, m.type.c_str(), static_cast<int>(m.type.size()), SQLITE_STATIC);
+        bind_optional(4, m.recipient);
+        bind_optional(5, m.file_path);
+        int rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE) {
+            std::cerr << "SQL insert error (messages): " << sqlite3_errmsg(db_) << " (code: " << rc << ")" << std::endl;
+            return false;
+        }
+        m.id = sqlite3_last_insert_rowid(db_);
+        return true;
+    }
+
+    std::int64_t latest_id() override {
+        std::int64_t id = 0;
+        query("SELECT MAX(id) FROM messages;", [](sqlite3_stmt*) {}, [&id](sqlite3_stmt* stmt) {
+            id = sqlite3_column_int64(stmt, 0);
+            });
+        return id;
+    }
+
+    std::optional<stored_message> get(std::int64_t id) override {
+        auto rows = select("WHERE id = ?;", [id](sqlite3_stmt* stmt) {
+            sqlite3_bind_int64(stmt, 1, id);
+            });
+        if (rows.empty()) {
+            return std::nullopt;
+        }
+        return std::move(rows.front());
+    }
+
+    std::vector<stored_message> history(std::int64_t before, int limit) override {
+        return select("WHERE recipient IS NULL AND id < ? ORDER BY id DESC LIMIT ?;", [=](sqlite3_stmt* stmt) {
+            sqlite3_bind_int64(stmt, 1, before);
+            sqlite3_bind_int(stmt, 2, limit);
+            });
+    }
+
+    std::vector<stored_message> search(const std::string& text, int limit) override {
+        std::string pattern = "%";
+        for (char c : text) {
+            if (c == '%' || c == '_' || c == '\\') {
+                pattern += '\\';
+            }
+            pattern += c;
+        }
+        pattern += "%";
+        return select("WHERE recipient IS NULL AND content LIKE ? ESCAPE '\\' ORDER BY id DESC LIMIT ?;", [&](sqlite3_stmt* stmt) {
+            sqlite3_bind_text(stmt, 1, pattern.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int(stmt, 2, limit);
+            });
+    }
+
+    // По индексу (user, recipient, id): каждая ветка OR - диапазон индекса
+    std::vector<stored_message> conversation(const std::string& a, const std::string& b, int limit) override {
+        return select("WHERE (user = ?1 AND recipient = ?2) OR (user = ?2 AND recipient = ?1) "
+            "ORDER BY id DESC LIMIT ?3;", [&](sqlite3_stmt* stmt) {
+                sqlite3_bind_text(stmt, 1, a.c_str(), -1, SQLITE_STATIC);
+                sqlite3_bind_text(stmt, 2, b.c_str(), -1, SQLITE_STATIC);
+                sqlite3_bind_int(stmt, 3, limit);
+            });
+    }
+
+    std::int64_t count_public_after(std::int64_t after) override {
+        std::int64_t count = 0;
+        query("SELECT COUNT(*) FROM messages WHERE id > ? AND recipient IS NULL;", [after](sqlite3_stmt* stmt) {
+            sqlite3_bind_int64(stmt, 1, after);
+            }, [&count](sqlite3_stmt* stmt) {
+                count = sqlite3_column_int64(stmt, 0);
+            });
+        return count;
+    }
+
+    // Отправители и диапазоны id - по idx_messages_inbox (recipient, user)
+    std::vector<std::pair<std::string, std::int64_t>> unread_direct(const std::string& user,
+        const std::function<std::int64_t(const std::string&)>& mark) override {
+        std::vector<std::string> peers;
+        query("SELECT DISTINCT user FROM messages WHERE recipient = ?;", [&user](sqlite3_stmt* stmt) {
+            sqlite3_bind_text(stmt, 1, user.c_str(), -1, SQLITE_STATIC);
+            }, [&peers](sqlite3_stmt* stmt) {
+                peers.emplace_back(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
+            });
+        std::vector<std::pair<std::string, std::int64_t>> unread;
+        for (const auto& peer : peers) {
+            std::int64_t after = mark(peer);
+            query("SELECT COUNT(*) FROM messages WHERE user = ? AND recipient = ? AND id > ?;", [&](sqlite3_stmt* stmt) {
+                sqlite3_bind_text(stmt, 1, peer.c_str(), -1, SQLITE_STATIC);
+                sqlite3_bind_text(stmt, 2, user.c_str(), -1, SQLITE_STATIC);
+                sqlite3_bind_int64(stmt, 3, after);
+                }, [&](sqlite3_stmt* stmt) {
+                    if (auto count = sqlite3_column_int64(stmt, 0)) {
+                        unread.emplace_back(peer, count);
+                    }
+                });
+        }
+        return unread;
+    }
+
+    // Цикл очистки: сначала один раз находим границы (id, до которого удалять),
+    // затем удаляем порциями по id - каждый DELETE короткий и идёт по индексу
+    std::size_t expire(const retention_policy& policy, std::size_t batch, std::vector<std::string>& files) override {
+        if (!expiring_) {
+            plan_expiry(policy);
+            expiring_ = true;
+        }
+        while (!expiry_plan_.empty()) {
+            std::size_t deleted = delete_batch(expiry_plan_.front(), batch, files);
+            if (deleted >= batch) {
+                return deleted;
+            }
+            expiry_plan_.pop_front();
+            if (deleted > 0) {
+                return deleted;
+            }
+        }
+        expiring_ = false;
+        return 0;
+    }
+
+    // Нужен auto_vacuum = INCREMENTAL, его включает main
+    std::int64_t compact(int pages) override {
+        auto freelist = [this]() {
+            std::int64_t count = 0;
+            query("PRAGMA freelist_count;", [](sqlite3_stmt*) {}, [&count](sqlite3_stmt* stmt) {
+                count = sqlite3_column_int64(stmt, 0);
+                });
+            return count;
+        };
+        std::int64_t before = freelist();
+        if (before == 0) {
+            return 0;
+        }
+        query("PRAGMA incremental_vacuum(" + std::to_string(pages) + ");", [](sqlite3_stmt*) {}, [](sqlite3_stmt*) {});
+        return before - freelist();
+    }
+
+    // id последних limit сообщений общего чата, от новых к старым
+    std::vector<std::int64_t> newest_public_ids(std::int64_t limit) {
+        std::vector<std::int64_t> ids;
+        query("SELECT id FROM messages WHERE recipient IS NULL ORDER BY id DESC LIMIT ?;", [limit](sqlite3_stmt* stmt) {
+            sqlite3_bind_int64(stmt, 1, limit);
+            }, [&ids](sqlite3_stmt* stmt) {
+                ids.push_back(sqlite3_column_int64(stmt, 0));
+            });
+        return ids;
+    }
+
+    // id растут вместе со временем: берём по первичному ключу и отрезаем по дате
+    std::vector<stored_message> oldest(std::int64_t after, const std::string& timestamp, int limit) override {
+        auto rows = select("WHERE id > ? ORDER BY id LIMIT ?;", [=](sqlite3_stmt* stmt) {
+            sqlite3_bind_int64(stmt, 1, after);
+            sqlite3_bind_int(stmt, 2, limit);
+            });
+        auto young = std::find_if(rows.begin(), rows.end(), [&timestamp](const stored_message& m) {
+            return m.timestamp >= timestamp;
+            });
+        rows.erase(young, rows.end());
+        return rows;
+    }
+
+    std::size_t remove_through(std::int64_t up_to, std::size_t batch) override {
+        std::vector<std::string> files;
+        return delete_batch({ "1", {}, up_to }, batch, files);
+    }
+
+private:
+    // Удалить сообщения с id <= up_to, подходящие под filter (параметры - args)
+    struct expiry_step {
+        std::string filter;
+        std::vector<std::string> args;
+        std::int64_t up_to;
+    };
+
+    void plan_expiry(const retention_policy& policy) {
+        expiry_plan_.clear();
+        if (policy.max_age.count() > 0) {
+            // id растут вместе со временем: граница - первое сообщение моложе срока
+            std::string cutoff = utc_timestamp(std::time(nullptr) - policy.max_age.count());
+            std::int64_t first_kept = latest_id() + 1;
+            query("SELECT id FROM messages WHERE timestamp >= ? ORDER BY id LIMIT 1;", [&cutoff](sqlite3_stmt* stmt) {
+                sqlite3_bind_text(stmt, 1, cutoff.c_str(), -1, SQLITE_STATIC);
+                }, [&first_kept](sqlite3_stmt* stmt) {
+                    first_kept = sqlite3_column_int64(stmt, 0);
+                });
+            if (first_kept > 1) {
+                expiry_plan_.push_back({ "1", {}, first_kept - 1 });
+            }
+        }
+        if (policy.max_rows > 0) {
+            auto last_dropped = [&](const std::string& filter, const std::vector<std::string>& args) {
+                std::int64_t id = 0;
+                query("SELECT id FROM messages WHERE " + filter + " ORDER BY id DESC LIMIT 1 OFFSET ?;", [&](sqlite3_stmt* stmt) {
+                    bind_args(stmt, args);
+                    sqlite3_bind_int64(stmt, static_cast<int>(args.size()) + 1, policy.max_rows);
+                    }, [&id](sqlite3_stmt* stmt) {
+                        id = sqlite3_column_int64(stmt, 0);
+                    });
+                if (id > 0) {
+                    expiry_plan_.push_back({ filter, args, id });
+                }
+            };
+            if (!policy.general_through) {
+                last_dropped("recipient IS NULL", {});
+            }
+            else if (*policy.general_through > 0) {
+                expiry_plan_.push_back({ "recipient IS NULL", {}, *policy.general_through });
+            }
+            // Переполненные направления личной переписки - по idx_messages_dm
+            std::vector<std::vector<std::string>> directions;
+            query("SELECT user, recipient FROM messages WHERE recipient IS NOT NULL "
+                "GROUP BY user, recipient HAVING COUNT(*) > ?;", [&](sqlite3_stmt* stmt) {
+                    sqlite3_bind_int64(stmt, 1, policy.max_rows);
+                }, [&directions](sqlite3_stmt* stmt) {
+                    directions.push_back({ reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)),
+                        reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)) });
+                });
+            for (const auto& args : directions) {
+                last_dropped("user = ? AND recipient = ?", args);
+            }
+        }
+    }
+
+    std::size_t delete_batch(const expiry_step& step, std::size_t batch, std::vector<std::string>& files) {
+        std::size_t deleted = 0;
+        query("DELETE FROM messages WHERE id IN (SELECT id FROM messages WHERE " + step.filter
+            + " AND id <= ? ORDER BY id LIMIT ?) RETURNING file_path;", [&](sqlite3_stmt* stmt) {
+                bind_args(stmt, step.args);
+                sqlite3_bind_int64(stmt, static_cast<int>(step.args.size()) + 1, step.up_to);
+                sqlite3_bind_int64(stmt, static_cast<int>(step.args.size()) + 2, static_cast<sqlite3_int64>(batch));
+            }, [&](sqlite3_stmt* stmt) {
+                ++deleted;
+                if (auto path = sqlite3_column_text(stmt, 0)) {
+                    files.emplace_back(reinterpret_cast<const char*>(path));
+                }
+            });
+        return deleted;
+    }
+
+    static void bind_args(sqlite3_stmt* stmt, const std::vector<std::string>& args) {
+        for (std::size_t i = 0; i < args.size(); ++i) {
+            sqlite3_bind_text(stmt, static_cast<int>(i) + 1, args[i].c_str(), -1, SQLITE_STATIC);
+        }
+    }
+
+    template<class Bind, class Row>
+    bool query(const std::string& sql, Bind bind, Row row) {
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+            std::cerr << "SQL prepare error (messages): " << sqlite3_errmsg(db_) << std::endl;
+            return false;
+        }
+        bind(stmt);
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            row(stmt);
+        }
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE) {
+            std::cerr << "SQL select error (messages): " << sqlite3_errmsg(db_) << " (code: " << rc << ")" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    template<class Bind>
+    std::vector<stored_message> select(const std::string& where, Bind bind) {
+        std::vector<stored_message> rows;
+        query("SELECT id, user, content, type, recipient, file_path, timestamp FROM messages " + where, bind,
+            [&rows](sqlite3_stmt* stmt) {
+                auto column = [stmt](int i) {
+                    auto text = sqlite3_column_text(stmt, i);
+                    return text ? std::string(reinterpret_cast<const char*>(text)) : std::string();
+                };
+                stored_message m;
+                m.id = sqlite3_column_int64(stmt, 0);
+                m.user = column(1);
+                m.content = column(2);
+                m.type = column(3);
+                m.recipient = column(4);
+                m.file_path = column(5);
+                m.timestamp = column(6);
+                rows.push_back(std::move(m));
+            });
+        return rows;
+    }
+
+    sqlite3* db_;
+    std::deque<expiry_step> expiry_plan_;
+    bool expiring_ = false;
+};
+
+// Один процесс-писатель на журнал или набор шардов. При передаче сокета
+// (SIGUSR2) старый процесс ещё дописывает сообщения закрывающихся сессий,
+// поэтому новый ждёт, пока тот выйдет, а не пишет в те же файлы параллельно.
+bool lock_exclusive(const std::string& path, std::optional<boost::interprocess::file_lock>& lock,
+    std::chrono::seconds wait = std::chrono::seconds(30)) {
+    std::ofstream(path, std::ios::app).close();
+    try {
+        lock.emplace(path.c_str());
+        auto deadline = std::chrono::steady_clock::now() + wait;
+        bool waiting = false;
+        while (!lock->try_lock()) {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                std::cerr << "Cannot lock " << path << ": held by another process" << std::endl;
+                lock.reset();
+                return false;
+            }
+            if (!waiting) {
+                std::cout << "Waiting for another process to release " << path << "..." << std::endl;
+                waiting = true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+    catch (const boost::interprocess::interprocess_exception& e) {
+        std::cerr << "Cannot lock " << path << ": " << e.what() << std::endl;
+        lock.reset();
+        return false;
+    }
+    return true;
+}
+
+// Сегментный журнал: только дозапись в отображённые в память файлы
+// фиксированного размера (<каталог>/<первый id>.seg). Запись - заголовок с
+// CRC-32 и поля подряд, выровнено на 8 байт; нулевой размер - конец данных.
+// Разреженный индекс (каждая index_stride-я запись) переводит id в смещение,
+// чтение истории идёт прямо из отображения. fsync пакетный, раз в log_sync_window:
+// при падении теряется не больше последнего окна, оборванная запись
+// отбрасывается по CRC при открытии. Писатель один: <каталог>/lock.
+class segment_log_store : public message_store {
+public:
+    static constexpr std::uint64_t segment_size = 64ull * 1024 * 1024;
+    static constexpr std::size_t index_stride = 64;
+    // Поиск идёт на потоке ввода-вывода: он просматривает не больше стольких
+    // блоков индекса (по index_stride записей) от новых к старым
+    static constexpr std::size_t search_blocks = 256;
+
+    explicit segment_log_store(std::string dir) : dir_(std::move(dir)) {
+    }
+
+    const char* name() const override {
+        return "log";
+    }
+
+    // Поднимает индекс по существующим сегментам
+    bool open() {
+        std::error_code ec;
+        std::filesystem::create_directories(dir_, ec);
+        if (ec) {
+            std::cerr << "Cannot create " << dir_ << ": " << ec.message() << std::endl;
+            return false;
+        }
+        if (!lock_exclusive((std::filesystem::path(dir_) / "lock").string(), lock_)) {
+            return false;
+        }
+        std::vector<std::filesystem::path> files;
+        for (const auto& entry : std::filesystem::directory_iterator(dir_, ec)) {
+            if (entry.path().extension() == ".seg") {
+                files.push_back(entry.path());
+            }
+        }
+        std::sort(files.begin(), files.end());
+        for (const auto& path : files) {
+            if (!map_segment(path.string())) {
+                return false;
+            }
+            recover(segments_.size() - 1);
+        }
+        std::cout << "Message log: " << segments_.size() << " segments, last id " << next_id_ - 1 << std::endl;
+        return true;
+    }
+
+    bool append(stored_message& m) override {
+        std::uint32_t lengths[5] = {
+            static_cast<std::uint32_t>(m.user.size()), static_cast<std::uint32_t>(m.type.size()),
+            static_cast<std::uint32_t>(m.recipient.size()), static_cast<std::uint32_t>(m.file_path.size()),
+            static_cast<std::uint32_t>(m.content.size())
+        };
+        std::uint64_t payload = 0;
+        for (auto length : lengths) {
+            payload += length;
+        }
+        std::uint64_t size = (sizeof(record_header) + payload + 7) & ~std::uint64_t(7);
+        if (size > segment_size) {
+            std::cerr << "Message log: record of " << size << " bytes does not fit a segment" << std::endl;
+            return false;
+        }
+        if (segments_.empty() || segments_.back()->end + size > segment_size) {
+            if (!segments_.empty()) {
+                flush_segment(*segments_.back());
+            }
+            std::string path = (std::filesystem::path(dir_) / (segment_name(next_id_) + ".seg")).string();
+            std::error_code ec;
+            std::ofstream(path, std::ios::binary | std::ios::app).close();
+            std::filesystem::resize_file(path, segment_size, ec);
+            if (ec || !map_segment(path)) {
+                std::cerr << "Message log: cannot create " << path << std::endl;
+                return false;
+            }
+            ++metrics.log_segments_created;
+        }
+        segment& seg = *segments_.back();
+        char* at = seg.data() + seg.end;
+
+        record_header h;
+        h.size = static_cast<std::uint32_t>(size);
+        h.reserved = 0;
+        h.id = next_id_;
+        h.time = static_cast<std::int64_t>(std::time(nullptr));
+        std::copy(std::begin(lengths), std::end(lengths), h.lengths);
+        char* p = at + sizeof(h);
+        for (const std::string* field : { &m.user, &m.type, &m.recipient, &m.file_path, &m.content }) {
+            p = std::copy(field->begin(), field->end(), p);
+        }
+        std::fill(p, at + size, 0);
+        std::memcpy(at, &h, sizeof(h));
+        boost::crc_32_type crc;
+        crc.process_bytes(at + crc_offset, size - crc_offset);
+        std::uint32_t checksum = crc.checksum();
+        std::memcpy(at + offsetof(record_header, crc), &checksum, sizeof(checksum));
+        // Метка конца: за записью может лежать хвост, отброшенный при восстановлении
+        if (seg.end + size + sizeof(std::uint32_t) <= segment_size) {
+            std::memset(at + size, 0, sizeof(std::uint32_t));
+        }
+
+        index_record(segments_.size() - 1, seg.end, h.id, m.user, m.recipient);
+        if (seg.first_id == 0) {
+            seg.first_id = h.id;
+        }
+        seg.end += size;
+        m.id = next_id_++;
+        ++metrics.log_appends;
+        schedule_sync();
+        return true;
+    }
+
+    std::int64_t latest_id() override {
+        return next_id_ - 1;
+    }
+
+    std::optional<stored_message> get(std::int64_t id) override {
+        auto it = std::upper_bound(index_.begin(), index_.end(), id, [](std::int64_t id, const index_entry& e) {
+            return id < e.id;
+            });
+        if (it == index_.begin()) {
+            return std::nullopt;
+        }
+        --it;
+        const segment& seg = *segments_[it->segment];
+        for (std::uint64_t offset = it->offset; offset < seg.end;) {
+            auto h = header_at(seg, offset);
+            if (h.id == id) {
+                return decode(seg, offset);
+            }
+            if (h.id > id) {
+                break;
+            }
+            offset += h.size;
+        }
+        return std::nullopt;
+    }
+
+    std::vector<stored_message> history(std::int64_t before, int limit) override {
+        std::vector<stored_message> rows;
+        scan_back(before, [&](stored_message&& m) {
+            if (m.recipient.empty()) {
+                rows.push_back(std::move(m));
+            }
+            return rows.size() < static_cast<std::size_t>(limit);
+            });
+        return rows;
+    }
+
+    std::vector<stored_message> search(const std::string& text, int limit) override {
+        std::vector<stored_message> rows;
+        auto equal = [](char a, char b) {
+            return std::tolower(static_cast<unsigned char>(a)) == std::tolower(static_cast<unsigned char>(b));
+        };
+        scan_back(INT64_MAX, [&](stored_message&& m) {
+            if (m.recipient.empty() && std::search(m.content.begin(), m.content.end(), text.begin(), text.end(), equal) != m.content.end()) {
+                rows.push_back(std::move(m));
+            }
+            return rows.size() < static_cast<std::size_t>(limit);
+            }, search_blocks);
+        return rows;
+    }
+
+    // id личных сообщений лежат в памяти по парам (получатель, отправитель)
+    std::vector<stored_message> conversation(const std::string& a, const std::string& b, int limit) override {
+        std::vector<std::int64_t> ids;
+        for (const auto& [to, from] : { std::pair(&a, &b), std::pair(&b, &a) }) {
+            auto inbox = inbox_.find(*to);
+            if (inbox == inbox_.end()) {
+                continue;
+            }
+            auto sent = inbox->second.find(*from);
+            if (sent != inbox->second.end()) {
+                auto& list = sent->second;
+                ids.insert(ids.end(), list.end() - std::min<std::size_t>(list.size(), limit), list.end());
+            }
+        }
+        std::sort(ids.rbegin(), ids.rend());
+        ids.resize(std::min<std::size_t>(ids.size(), limit));
+        std::vector<stored_message> rows;
+        for (auto id : ids) {
+            if (auto m = get(id)) {
+                rows.push_back(std::move(*m));
+            }
+        }
+        return rows;
+    }
+
+    // id выдаются подряд: публичных выше after столько, сколько живых id выше него,
+    // минус личные из direct_ids_. Без чтения записей - для unread при каждом входе.
+    std::int64_t count_public_after(std::int64_t after) override {
+        std::int64_t first = first_live_ < segments_.size() ? segments_[first_live_]->first_id : next_id_;
+        after = std::max(after, first - 1);
+        if (after >= latest_id()) {
+            return 0;
+        }
+        auto direct = direct_ids_.end() - std::upper_bound(direct_ids_.begin(), direct_ids_.end(), after);
+        return latest_id() - after - direct;
+    }
+
+    std::vector<std::pair<std::string, std::int64_t>> unread_direct(const std::string& user,
+        const std::function<std::int64_t(const std::string&)>& mark) override {
+        std::vector<std::pair<std::string, std::int64_t>> unread;
+        auto inbox = inbox_.find(user);
+        if (inbox == inbox_.end()) {
+            return unread;
+        }
+        for (const auto& [peer, ids] : inbox->second) {
+            auto count = ids.end() - std::upper_bound(ids.begin(), ids.end(), mark(peer));
+            if (count > 0) {
+                unread.emplace_back(peer, count);
+            }
+        }
+        return unread;
+    }
+
+    void sync() override {
+        sync_scheduled_ = false;
+        if (!segments_.empty()) {
+            flush_segment(*segments_.back());
+        }
+    }
+
+    // Журнал только дописывается, поэтому срок хранения соблюдается целыми
+    // сегментами: самый старый удаляется, когда его последняя запись старше
+    // max_age. Текущий сегмент не трогаем; max_rows здесь не применяется.
+    std::size_t expire(const retention_policy& policy, std::size_t, std::vector<std::string>& files) override {
+        if (policy.max_age.count() <= 0 || first_live_ + 1 >= segments_.size()) {
+            return 0;
+        }
+        const segment& seg = *segments_[first_live_];
+        std::int64_t newest = 0;
+        std::size_t count = 0;
+        for (std::uint64_t offset = 0; offset < seg.end; offset += header_at(seg, offset).size) {
+            newest = header_at(seg, offset).time;
+            ++count;
+        }
+        if (newest >= static_cast<std::int64_t>(std::time(nullptr)) - policy.max_age.count()) {
+            return 0;
+        }
+        for (std::uint64_t offset = 0; offset < seg.end; offset += header_at(seg, offset).size) {
+            auto m = decode(seg, offset);
+            if (!m.file_path.empty()) {
+                files.push_back(std::move(m.file_path));
+            }
+        }
+        std::string path = seg.path;
+        std::int64_t first_kept = segments_[first_live_ + 1]->first_id;
+        segments_[first_live_].reset();
+        ++first_live_;
+        std::error_code ec;
+        std::filesystem::remove(path, ec);
+        index_.erase(index_.begin(), std::lower_bound(index_.begin(), index_.end(), first_kept,
+            [](const index_entry& e, std::int64_t id) {
+                return e.id < id;
+            }));
+        for (auto& [recipient, senders] : inbox_) {
+            for (auto& [sender, ids] : senders) {
+                ids.erase(ids.begin(), std::lower_bound(ids.begin(), ids.end(), first_kept));
+            }
+        }
+        direct_ids_.erase(direct_ids_.begin(), std::lower_bound(direct_ids_.begin(), direct_ids_.end(), first_kept));
+        std::cout << "Message log: removed expired segment " << path << std::endl;
+        return std::max<std::size_t>(count, 1);
+    }
+
+private:
+    struct record_header {
+        std::uint32_t size;   // вся запись вместе с заголовком и выравниванием
+        std::uint32_t crc;    // CRC-32 всего, что после этого поля
+        std::int64_t id;
+        std::int64_t time;    // секунды Unix
+        std::uint32_t lengths[5]; // user, type, recipient, file_path, content
+        std::uint32_t reserved;
+    };
+    static constexpr std::size_t crc_offset = offsetof(record_header, id);
+
+    struct segment {
+        std::string path;
+        std::int64_t first_id = 0;
+        std::uint64_t end = 0;      // конец последней целой записи
+        std::uint64_t synced = 0;   // до этого смещения данные уже на диске
+        boost::interprocess::file_mapping file;
+        boost::interprocess::mapped_region region;
+
+        char* data() const {
+            return static_cast<char*>(region.get_address());
+        }
+    };
+
+    struct index_entry {
+        std::int64_t id;
+        std::size_t segment;
+        std::uint64_t offset;
+    };
+
+    static std::string segment_name(std::int64_t first_id) {
+        std::string name = std::to_string(first_id);
+        return std::string(20 - name.size(), '0') + name;
+    }
+
+    bool map_segment(const std::string& path) {
+        namespace bip = boost::interprocess;
+        try {
+            auto seg = std::make_unique<segment>();
+            seg->path = path;
+            seg->file = bip::file_mapping(path.c_str(), bip::read_write);
+            seg->region = bip::mapped_region(seg->file, bip::read_write);
+            if (seg->region.get_size() != segment_size) {
+                std::cerr << "Message log: " << path << " has unexpected size " << seg->region.get_size() << std::endl;
+                return false;
+            }
+            segments_.push_back(std::move(seg));
+            return true;
+        }
+        catch (const bip::interprocess_exception& e) {
+            std::cerr << "Message log: cannot map " << path << ": " << e.what() << std::endl;
+            return false;
+        }
+    }
+
+    static record_header header_at(const segment& seg, std::uint64_t offset) {
+        record_header h;
+        std::memcpy(&h, seg.data() + offset, sizeof(h));
+        return h;
+    }
+
+    // Проходит записи сегмента до первой битой (оборванная запись при падении)
+    void recover(std::size_t index) {
+        segment& seg = *segments_[index];
+        std::uint64_t offset = 0;
+        while (offset + sizeof(record_header) <= segment_size) {
+            auto h = header_at(seg, offset);
+            if (h.size == 0 || h.size < sizeof(record_header) || offset + h.size > segment_size || h.id < next_id_) {
+                break;
+            }
+            boost::crc_32_type crc;
+            crc.process_bytes(seg.data() + offset + crc_offset, h.size - crc_offset);
+            if (crc.checksum() != h.crc) {
+                std::cerr << "Message log: bad checksum in " << seg.path << " at offset " << offset
+                    << ", dropping the tail" << std::endl;
+                break;
+            }
+            auto m = decode(seg, offset);
+            index_record(index, offset, h.id, m.user, m.recipient);
+            if (seg.first_id == 0) {
+                seg.first_id = h.id;
+            }
+            next_id_ = h.id + 1;
+            offset += h.size;
+        }
+        seg.end = offset;
+        seg.synced = offset;
+    }
+
+    void index_record(std::size_t segment, std::uint64_t offset, std::int64_t id,
+        const std::string& user, const std::string& recipient) {
+        if (offset == 0 || ++since_index_ >= index_stride) {
+            index_.push_back({ id, segment, offset });
+            since_index_ = 0;
+        }
+        if (!recipient.empty()) {
+            inbox_[recipient][user].push_back(id);
+            direct_ids_.push_back(id);
+        }
+    }
+
+    stored_message decode(const segment& seg, std::uint64_t offset) const {
+        auto h = header_at(seg, offset);
+        const char* p = seg.data() + offset + sizeof(h);
+        stored_message m;
+        m.id = h.id;
+        for (auto [field, length] : {
+            std::pair(&m.user, h.lengths[0]), std::pair(&m.type, h.lengths[1]),
+            std::pair(&m.recipient, h.lengths[2]), std::pair(&m.file_path, h.lengths[3]),
+            std::pair(&m.content, h.lengths[4]) }) {
+            field->assign(p, length);
+            p += length;
+        }
+        m.timestamp = utc_timestamp(static_cast<std::time_t>(h.time));
+        return m;
+    }
+
+    // От новых к старым, начиная с id < before; visit возвращает false, чтобы остановиться.
+    // Блок между соседними точками индекса читается вперёд и отдаётся в обратном порядке;
+    // max_blocks - сколько блоков прочитать самое большее.
+    template<class Visit>
+    void scan_back(std::int64_t before, Visit visit, std::size_t max_blocks = SIZE_MAX) {
+        auto first = std::lower_bound(index_.begin(), index_.end(), before, [](const index_entry& e, std::int64_t id) {
+            return e.id < id;
+            });
+        std::vector<stored_message> block;
+        for (auto k = first - index_.begin(); k-- > 0 && max_blocks-- > 0;) {
+            const index_entry& from = index_[k];
+            const segment& seg = *segments_[from.segment];
+            std::int64_t stop = before;
+            if (static_cast<std::size_t>(k) + 1 < index_.size() && index_[k + 1].segment == from.segment) {
+                stop = std::min(stop, index_[k + 1].id);
+            }
+            block.clear();
+            for (std::uint64_t offset = from.offset; offset < seg.end;) {
+                auto h = header_at(seg, offset);
+                if (h.id >= stop) {
+                    break;
+                }
+                block.push_back(decode(seg, offset));
+                offset += h.size;
+            }
+            for (auto it = block.rbegin(); it != block.rend(); ++it) {
+                if (!visit(std::move(*it))) {
+                    return;
+                }
+            }
+        }
+    }
+
+    void flush_segment(segment& seg) {
+        if (seg.end == seg.synced) {
+            return;
+        }
+        // msync работает постранично: начинаем с границы страницы
+        std::uint64_t page = boost::interprocess::mapped_region::get_page_size();
+        std::uint64_t from = seg.synced / page * page;
+        seg.region.flush(static_cast<std::size_t>(from), static_cast<std::size_t>(seg.end - from), false);
+        seg.synced = seg.end;
+        ++metrics.log_syncs;
+    }
+
+    void schedule_sync() {
+        if (sync_scheduled_) {
+            return;
+        }
+        sync_scheduled_ = true;
+        timers.schedule(config.log_sync_window, [this]() {
+            sync();
+            });
+    }
+
+    std::string dir_;
+    // Объявлена до сегментов: отпускается последней, после их закрытия
+    std::optional<boost::interprocess::file_lock> lock_;
+    std::vector<std::unique_ptr<segment>> segments_; // удалённые по сроку - nullptr
+    std::size_t first_live_ = 0;
+    std::vector<index_entry> index_;
+    std::size_t since_index_ = 0;
+    // получатель -> отправитель -> id личных сообщений по возрастанию
+    std::unordered_map<std::string, std::map<std::string, std::vector<std::int64_t>>> inbox_;
+    std::vector<std::int64_t> direct_ids_; // все личные по возрастанию
+    std::int64_t next_id_ = 1;
+    bool sync_scheduled_ = false;
+};
+
+// Всё в памяти процесса: rows_ идут подряд по id начиная с first_id_
+class memory_message_store : public message_store {
+public:
+    const char* name() const override {
+        return "memory";
+    }
+
+    bool append(stored_message& m) override {
+        m.id = latest_id() + 1;
+        m.timestamp = utc_timestamp(std::time(nullptr));
+        if (!m.recipient.empty()) {
+            inbox_[m.recipient][m.user].push_back(m.id);
+        }
+        rows_.push_back(m);
+        return true;
+    }
+
+    std::int64_t latest_id() override {
+        return first_id_ + static_cast<std::int64_t>(rows_.size()) - 1;
+    }
+
+    std::optional<stored_message> get(std::int64_t id) override {
+        if (id < first_id_ || id > latest_id()) {
+            return std::nullopt;
+        }
+        return at(id);
+    }
+
+    std::vector<stored_message> history(std::int64_t before, int limit) override {
+        return collect(before, limit, [](const stored_message& m) {
+            return m.recipient.empty();
+            });
+    }
+
+    std::vector<stored_message> search(const std::string& text, int limit) override {
+        auto equal = [](char a, char b) {
+            return std::tolower(static_cast<unsigned char>(a)) == std::tolower(static_cast<unsigned char>(b));
+        };
+        return collect(INT64_MAX, limit, [&](const stored_message& m) {
+            return m.recipient.empty() && std::search(m.content.begin(), m.content.end(), text.begin(), text.end(), equal) != m.content.end();
+            });
+    }
+
+    std::vector<stored_message> conversation(const std::string& a, const std::string& b, int limit) override {
+        std::vector<std::int64_t> ids;
+        for (const auto& [to, from] : { std::pair(&a, &b), std::pair(&b, &a) }) {
+            auto inbox = inbox_.find(*to);
+            if (inbox == inbox_.end()) {
+                continue;
+            }
+            auto sent = inbox->second.find(*from);
+            if (sent != inbox->second.end()) {
+                ids.insert(ids.end(), sent->second.begin(), sent->second.end());
+            }
+        }
+        std::sort(ids.rbegin(), ids.rend());
+        ids.resize(std::min<std::size_t>(ids.size(), limit));
+        std::vector<stored_message> rows;
+        for (auto id : ids) {
+            rows.push_back(at(id));
+        }
+        return rows;
+    }
+
+    std::int64_t count_public_after(std::int64_t after) override {
+        std::int64_t count = 0;
+        for (auto id = std::max(after + 1, first_id_); id <= latest_id(); ++id) {
+            count += at(id).recipient.empty();
+        }
+        return count;
+    }
+
+    std::vector<std::pair<std::string, std::int64_t>> unread_direct(const std::string& user,
+        const std::function<std::int64_t(const std::string&)>& mark) override {
+        std::vector<std::pair<std::string, std::int64_t>> unread;
+        auto inbox = inbox_.find(user);
+        if (inbox == inbox_.end()) {
+            return unread;
+        }
+        for (const auto& [peer, ids] : inbox->second) {
+            auto count = ids.end() - std::upper_bound(ids.begin(), ids.end(), mark(peer));
+            if (count > 0) {
+                unread.emplace_back(peer, count);
+            }
+        }
+        return unread;
+    }
+
+    // Удалять можно только с начала, поэтому здесь только срок хранения
+    std::size_t expire(const retention_policy& policy, std::size_t batch, std::vector<std::string>& files) override {
+        if (policy.max_age.count() <= 0) {
+            return 0;
+        }
+        std::string cutoff = utc_timestamp(std::time(nullptr) - policy.max_age.count());
+        std::size_t deleted = 0;
+        while (deleted < batch && !rows_.empty() && rows_.front().timestamp < cutoff) {
+            if (!rows_.front().file_path.empty()) {
+                files.push_back(std::move(rows_.front().file_path));
+            }
+            rows_.pop_front();
+            ++first_id_;
+            ++deleted;
+        }
+        if (deleted > 0) {
+            for (auto& [recipient, senders] : inbox_) {
+                for (auto& [sender, ids] : senders) {
+                    ids.erase(ids.begin(), std::lower_bound(ids.begin(), ids.end(), first_id_));
+                }
+            }
+        }
+        return deleted;
+    }
+
+private:
+    const stored_message& at(std::int64_t id) const {
+        return rows_[static_cast<std::size_t>(id - first_id_)];
+    }
+
+    template<class Match>
+    std::vector<stored_message> collect(std::int64_t before, int limit, Match match) const {
+        std::vector<stored_message> rows;
+        auto last = first_id_ + static_cast<std::int64_t>(rows_.size()) - 1;
+        for (auto id = std::min(before - 1, last); id >= first_id_ && rows.size() < static_cast<std::size_t>(limit); --id) {
+            if (match(at(id))) {
+                rows.push_back(at(id));
+            }
+        }
+        return rows;
+    }
+
+    std::deque<stored_message> rows_;
+    std::int64_t first_id_ = 1;
+    std::unordered_map<std::string, std::map<std::string, std::vector<std::int64_t>>> inbox_;
+};
+
+// Ничего не хранит: id выдаются, история всегда пустая
+class null_message_store : public message_store {
+public:
+    const char* name() const override {
+        return "null";
+    }
+    bool append(stored_message& m) override {
+        m.id = ++last_id_;
+        return true;
+    }
+    std::int64_t latest_id() override {
+        return last_id_;
+    }
+    std::optional<stored_message> get(std::int64_t) override {
+        return std::nullopt;
+    }
+    std::vector<stored_message> history(std::int64_t, int) override {
+        return {};
+    }
+    std::vector<stored_message> search(const std::string&, int) override {
+        return {};
+    }
+    std::vector<stored_message> conversation(const std::string&, const std::string&, int) override {
+        return {};
+    }
+    std::int64_t count_public_after(std::int64_t) override {
+        return 0;
+    }
+    std::vector<std::pair<std::string, std::int64_t>> unread_direct(const std::string&,
+        const std::function<std::int64_t(const std::string&)>&) override {
+        return {};
+    }
+
+private:
+    std::int64_t last_id_ = 0;
+};
+
+// FNV-1a: одинаков во всех сборках, годится для данных на диске и выбора шарда
+std::uint64_t fnv1a(std::string_view text, std::uint64_t h = 14695981039346656037ull) {
+    for (unsigned char c : text) {
+        h = (h ^ c) * 1099511628211ull;
+    }
+    return h;
+}
+
+// Сжатие блоков архива в духе LZ4: последовательности "литералы + совпадение",
+// смещение 16 бит. dict - общий словарь: совпадения могут ссылаться на него
+// как на данные перед блоком, поэтому и короткие блоки сжимаются хорошо.
+std::string lz_compress(std::string_view dict, std::string_view input) {
+    constexpr std::size_t min_match = 4;
+    constexpr std::size_t max_offset = 65535;
+    constexpr int hash_bits = 14;
+    std::string window;
+    window.reserve(dict.size() + input.size());
+    window.append(dict);
+    window.append(input);
+    auto hash = [&window](std::size_t i) {
+        std::uint32_t v;
+        std::memcpy(&v, window.data() + i, sizeof(v));
+        return (v * 2654435761u) >> (32 - hash_bits);
+    };
+    std::vector<std::size_t> table(std::size_t(1) << hash_bits, SIZE_MAX);
+    for (std::size_t i = 0; i + min_match <= dict.size(); ++i) {
+        table[hash(i)] = i;
+    }
+
+    std::string out;
+    std::size_t anchor = dict.size();
+    auto put_length = [&out](std::size_t length) {
+        for (; length >= 255; length -= 255) {
+            out += static_cast<char>(255);
+        }
+        out += static_cast<char>(length);
+    };
+    // match_length == 0 - последняя последовательность, только литералы
+    auto emit = [&](std::size_t literal_end, std::size_t match_length, std::size_t offset) {
+        std::size_t literals = literal_end - anchor;
+        std::size_t extra = match_length ? match_length - min_match : 0;
+        out += static_cast<char>((std::min<std::size_t>(literals, 15) << 4) | std::min<std::size_t>(extra, 15));
+        if (literals >= 15) {
+            put_length(literals - 15);
+        }
+        out.append(window, anchor, literals);
+        if (match_length) {
+            out += static_cast<char>(offset & 0xff);
+            out += static_cast<char>(offset >> 8);
+            if (extra >= 15) {
+                put_length(extra - 15);
+            }
+        }
+    };
+    std::size_t i = dict.size();
+    while (i + min_match <= window.size()) {
+        auto h = hash(i);
+        std::size_t candidate = table[h];
+        table[h] = i;
+        if (candidate != SIZE_MAX && i - candidate <= max_offset
+            && std::memcmp(window.data() + candidate, window.data() + i, min_match) == 0) {
+            std::size_t length = min_match;
+            while (i + length < window.size() && window[candidate + length] == window[i + length]) {
+                ++length;
+            }
+            emit(i, length, i - candidate);
+            i += length;
+            anchor = i;
+        }
+        else {
+            ++i;
+        }
+    }
+    emit(window.size(), 0, 0);
+    return out;
+}
+
+bool lz_decompress(std::string_view dict, std::string_view data, std::size_t raw_size, std::string& out) {
+    out.assign(dict);
+    out.reserve(dict.size() + raw_size);
+    std::size_t p = 0;
+    auto get_length = [&](std::size_t& length) {
+        unsigned char b;
+        do {
+            if (p >= data.size()) {
+                return false;
+            }
+            b = static_cast<unsigned char>(data[p++]);
+            length += b;
+        } while (b == 255);
+        return true;
+    };
+    while (p < data.size()) {
+        auto token = static_cast<unsigned char>(data[p++]);
+        std::size_t literals = token >> 4;
+        if ((literals == 15 && !get_length(literals)) || data.size() - p < literals) {
+            return false;
+        }
+        out.append(data.data() + p, literals);
+        p += literals;
+        if (p == data.size()) {
+            break;
+        }
+        if (data.size() - p < 2) {
+            return false;
+        }
+        std::size_t offset = static_cast<unsigned char>(data[p]) | (static_cast<std::size_t>(static_cast<unsigned char>(data[p + 1])) << 8);
+        p += 2;
+        std::size_t length = token & 15;
+        if (length == 15 && !get_length(length)) {
+            return false;
+        }
+        length += 4;
+        if (offset == 0 || offset > out.size() || out.size() - dict.size() + length > raw_size) {
+            return false;
+        }
+        // Совпадение может перекрываться с собой - копируем по байту
+        for (std::size_t from = out.size() - offset, k = 0; k < length; ++k) {
+            out += out[from + k];
+        }
+    }
+    if (out.size() - dict.size() != raw_size) {
+        return false;
+    }
+    out.erase(0, dict.size());
+    return true;
+}
+
+// Словарь по выборке сообщений: частые слова, логины, типы и даты. Самые
+// выгодные (частота * длина) ставятся в конец - ближе к данным блока.
+std::string train_dictionary(const std::vector<stored_message>& sample, std::size_t max_size) {
+    std::unordered_map<std::string, std::size_t> counts;
+    for (const auto& m : sample) {
+        ++counts[m.user];
+        ++counts[m.type];
+        ++counts[m.timestamp.substr(0, 11)];
+        if (!m.recipient.empty()) {
+            ++counts[m.recipient];
+        }
+        std::size_t begin = 0;
+        while (begin < m.content.size()) {
+            std::size_t end = m.content.find(' ', begin);
+            if (end == std::string::npos) {
+                end = m.content.size();
+            }
+            if (end - begin >= 3 && end - begin <= 64) {
+                ++counts[m.content.substr(begin, end - begin + (end < m.content.size()))];
+            }
+            begin = end + 1;
+        }
+    }
+    std::vector<std::pair<std::size_t, const std::string*>> ranked;
+    for (const auto& [word, count] : counts) {
+        if (count >= 2) {
+            ranked.emplace_back((count - 1) * word.size(), &word);
+        }
+    }
+    std::sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) {
+        return a.first != b.first ? a.first > b.first : *a.second < *b.second;
+        });
+    std::vector<const std::string*> chosen;
+    std::size_t size = 0;
+    for (const auto& [score, word] : ranked) {
+        if (size + word->size() > max_size) {
+            break;
+        }
+        chosen.push_back(word);
+        size += word->size();
+    }
+    std::string dict;
+    for (auto it = chosen.rbegin(); it != chosen.rend(); ++it) {
+        dict += **it;
+    }
+    return dict;
+}
+
+// Холодный уровень: неизменяемые файлы <каталог>/<первый id>.arc с блоками
+// по block_records сообщений, каждый блок сжат отдельно общим словарём
+// (<каталог>/<номер>.dict, обучается на первой же партии). В конце файла -
+// индекс блоков, он целиком держится в памяти; блок читается и распаковывается
+// только когда история до него дошла.
+class archive_tier {
+public:
+    static constexpr std::size_t block_records = 256;
+    static constexpr std::size_t block_bytes = 48 * 1024;
+    static constexpr std::size_t dictionary_size = 32 * 1024;
+
+    bool open(const std::string& dir) {
+        dir_ = dir;
+        std::error_code ec;
+        std::filesystem::create_directories(dir_, ec);
+        if (ec) {
+            std::cerr << "Cannot create " << dir_ << ": " << ec.message() << std::endl;
+            return false;
+        }
+        std::vector<std::filesystem::path> files;
+        for (const auto& entry : std::filesystem::directory_iterator(dir_, ec)) {
+            auto ext = entry.path().extension();
+            if (ext == ".tmp") {
+                // Недописанный файл: сообщения остались в горячем уровне
+                std::filesystem::remove(entry.path(), ec);
+            }
+            else if (ext == ".dict") {
+                std::ifstream in(entry.path(), std::ios::binary);
+                dictionaries_[std::atoi(entry.path().stem().string().c_str())].assign(
+                    std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            }
+            else if (ext == ".arc") {
+                files.push_back(entry.path());
+            }
+        }
+        std::sort(files.begin(), files.end());
+        for (const auto& path : files) {
+            load(path.string());
+        }
+        std::cout << "Archive: " << files_.size() << " files, last id " << last_id() << std::endl;
+        return true;
+    }
+
+    // 0 - архив пуст
+    std::int64_t last_id() const {
+        return files_.empty() ? 0 : files_.back().blocks.back().last_id;
+    }
+
+    std::optional<stored_message> get(std::int64_t id) {
+        for (const auto& file : files_) {
+            if (id < file.blocks.front().first_id || id > file.blocks.back().last_id) {
+                continue;
+            }
+            auto block = std::upper_bound(file.blocks.begin(), file.blocks.end(), id, [](std::int64_t id, const block_entry& b) {
+                return id < b.first_id;
+                }) - 1;
+            for (auto& m : read_block(file, *block)) {
+                if (m.id == id) {
+                    return std::move(m);
+                }
+            }
+        }
+        return std::nullopt;
+    }
+
+    // Ключ переписки для фильтра блоков, не зависит от порядка собеседников.
+    // Значение хранится в файле, поэтому FNV-1a, а не std::hash.
+    static std::uint64_t pair_hash(const std::string& a, const std::string& b) {
+        std::uint64_t h = fnv1a(std::min(a, b));
+        h = (h ^ 0xff) * 1099511628211ull;
+        return (fnv1a(std::max(a, b), h) ^ 0xff) * 1099511628211ull;
+    }
+
+    // От новых к старым, id < before; visit возвращает false, чтобы остановиться.
+    // pair - pair_hash переписки: блоки без неё пропускаются не распаковывая.
+    // max_blocks - сколько блоков распаковать самое большее.
+    template<class Visit>
+    void scan_back(std::int64_t before, Visit visit, std::optional<std::uint64_t> pair = std::nullopt,
+        std::size_t max_blocks = SIZE_MAX) {
+        for (auto file = files_.rbegin(); file != files_.rend(); ++file) {
+            for (auto block = file->blocks.rbegin(); block != file->blocks.rend(); ++block) {
+                if (block->first_id >= before || (pair && !bloom_test(*block, *pair))) {
+                    continue;
+                }
+                if (max_blocks-- == 0) {
+                    return;
+                }
+                auto rows = read_block(*file, *block);
+                for (auto it = rows.rbegin(); it != rows.rend(); ++it) {
+                    if (it->id < before && !visit(std::move(*it))) {
+                        return;
+                    }
+                }
+            }
+        }
+    }
+
+    // Сообщения общего чата с id в (after, up_to]; целые блоки - по счётчику из индекса
+    std::int64_t count_public(std::int64_t after, std::int64_t up_to) {
+        std::int64_t count = 0;
+        for (const auto& file : files_) {
+            for (const auto& block : file.blocks) {
+                if (block.last_id <= after || block.first_id > up_to) {
+                    continue;
+                }
+                if (block.first_id > after && block.last_id <= up_to) {
+                    count += block.public_count;
+                    continue;
+                }
+                for (const auto& m : read_block(file, block)) {
+                    count += m.id > after && m.id <= up_to && m.recipient.empty();
+                }
+            }
+        }
+        return count;
+    }
+
+    bool building() const {
+        return out_ != nullptr;
+    }
+    // id последнего сообщения, уже добавленного в архив (в том числе в недописанный файл)
+    std::int64_t last_added() const {
+        return building() ? pending_last_ : last_id();
+    }
+    std::size_t building_rows() const {
+        return building_rows_;
+    }
+
+    // rows - по возрастанию id
+    bool add(const std::vector<stored_message>& rows) {
+        if (!building() && !begin_file(rows)) {
+            return false;
+        }
+        for (const auto& m : rows) {
+            if (block_count_ == 0) {
+                block_.first_id = m.id;
+            }
+            std::uint32_t lengths[6] = {
+                static_cast<std::uint32_t>(m.user.size()), static_cast<std::uint32_t>(m.type.size()),
+                static_cast<std::uint32_t>(m.recipient.size()), static_cast<std::uint32_t>(m.file_path.size()),
+                static_cast<std::uint32_t>(m.content.size()), static_cast<std::uint32_t>(m.timestamp.size())
+            };
+            raw_.append(reinterpret_cast<const char*>(&m.id), sizeof(m.id));
+            raw_.append(reinterpret_cast<const char*>(lengths), sizeof(lengths));
+            for (const std::string* field : { &m.user, &m.type, &m.recipient, &m.file_path, &m.content, &m.timestamp }) {
+                raw_ += *field;
+            }
+            block_.last_id = m.id;
+            block_.public_count += m.recipient.empty();
+            if (!m.recipient.empty()) {
+                bloom_add(block_, pair_hash(m.user, m.recipient));
+            }
+            std::snprintf(block_.last_timestamp, sizeof(block_.last_timestamp), "%s", m.timestamp.c_str());
+            pending_last_ = m.id;
+            ++building_rows_;
+            if (++block_count_ >= block_records || raw_.size() >= block_bytes) {
+                if (!write_block()) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Дописывает индекс, fsync и переименование: после этого файл виден запросам
+    bool finish_file() {
+        if (block_count_ > 0 && !write_block()) {
+            return false;
+        }
+        trailer t{};
+        t.index_offset = offset_;
+        t.block_count = static_cast<std::uint32_t>(pending_.size());
+        boost::crc_32_type crc;
+        crc.process_bytes(pending_.data(), pending_.size() * sizeof(block_entry));
+        t.index_crc = crc.checksum();
+        std::memcpy(t.magic, trailer_magic, sizeof(t.magic));
+        bool ok = std::fwrite(pending_.data(), sizeof(block_entry), pending_.size(), out_) == pending_.size()
+            && std::fwrite(&t, sizeof(t), 1, out_) == 1 && std::fflush(out_) == 0;
+#ifdef _WIN32
+        ok = ok && _commit(_fileno(out_)) == 0;
+#else
+        ok = ok && fsync(fileno(out_)) == 0;
+#endif
+        std::fclose(out_);
+        out_ = nullptr;
+        std::string path = tmp_path_.substr(0, tmp_path_.size() - 4);
+        std::error_code ec;
+        if (ok) {
+            std::filesystem::rename(tmp_path_, path, ec);
+        }
+        if (!ok || ec) {
+            std::cerr << "Archive: cannot write " << path << std::endl;
+            std::filesystem::remove(tmp_path_, ec);
+            pending_.clear();
+            return false;
+        }
+        files_.push_back({ path, dictionary_id_, std::move(pending_) });
+        pending_.clear();
+        ++metrics.archive_files;
+        std::cout << "Archive: wrote " << path << " (" << building_rows_ << " messages)" << std::endl;
+        building_rows_ = 0;
+        return true;
+    }
+
+    // Бросает недописанный файл: сообщения остаются в горячем уровне
+    void abort_file() {
+        if (out_) {
+            std::fclose(out_);
+            out_ = nullptr;
+        }
+        std::error_code ec;
+        std::filesystem::remove(tmp_path_, ec);
+        pending_.clear();
+        block_ = block_entry{};
+        block_count_ = 0;
+        raw_.clear();
+        building_rows_ = 0;
+    }
+
+    // Удаляет самый старый файл, если все его сообщения старше cutoff
+    std::size_t drop_older_than(const std::string& cutoff, std::vector<std::string>& files) {
+        if (files_.empty() || files_.front().blocks.back().last_timestamp >= cutoff) {
+            return 0;
+        }
+        const archive_file& file = files_.front();
+        std::size_t count = 0;
+        for (const auto& block : file.blocks) {
+            for (auto& m : read_block(file, block)) {
+                if (!m.file_path.empty()) {
+                    files.push_back(std::move(m.file_path));
+                }
+                ++count;
+            }
+        }
+        std::error_code ec;
+        std::filesystem::remove(file.path, ec);
+        std::cout << "Archive: removed expired " << file.path << std::endl;
+        files_.erase(files_.begin());
+        return std::max<std::size_t>(count, 1);
+    }
+
+private:
+    struct block_entry {
+        std::int64_t first_id = 0;
+        std::int64_t last_id = 0;
+        std::uint64_t offset = 0;
+        std::uint32_t compressed_size = 0;
+        std::uint32_t raw_size = 0;
+        std::uint32_t crc = 0;          // CRC-32 сжатых данных
+        std::uint32_t public_count = 0;
+        char last_timestamp[24] = {};
+        std::uint64_t dm_bloom[4] = {}; // пары собеседников в блоке, см. pair_hash
+    };
+    static void bloom_add(block_entry& block, std::uint64_t h) {
+        for (unsigned bit : { static_cast<unsigned>(h & 255), static_cast<unsigned>((h >> 8) & 255) }) {
+            block.dm_bloom[bit / 64] |= std::uint64_t(1) << (bit % 64);
+        }
+    }
+    static bool bloom_test(const block_entry& block, std::uint64_t h) {
+        for (unsigned bit : { static_cast<unsigned>(h & 255), static_cast<unsigned>((h >> 8) & 255) }) {
+            if (!(block.dm_bloom[bit / 64] & (std::uint64_t(1) << (bit % 64)))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    struct header {
+        char magic[8];
+        std::uint32_t dictionary;
+        std::uint32_t reserved;
+    };
+    struct trailer {
+        std::uint64_t index_offset;
+        std::uint32_t block_count;
+        std::uint32_t index_crc;
+        char magic[8];
+    };
+    static constexpr char header_magic[9] = "MSGARC01";
+    static constexpr char trailer_magic[9] = "MSGARCIX";
+
+    struct archive_file {
+        std::string path;
+        int dictionary;
+        std::vector<block_entry> blocks;
+    };
+
+    void load(const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        header h{};
+        trailer t{};
+        in.read(reinterpret_cast<char*>(&h), sizeof(h));
+        in.seekg(-static_cast<std::streamoff>(sizeof(t)), std::ios::end);
+        in.read(reinterpret_cast<char*>(&t), sizeof(t));
+        archive_file file{ path, static_cast<int>(h.dictionary), std::vector<block_entry>(t.block_count) };
+        bool ok = in && std::memcmp(h.magic, header_magic, sizeof(h.magic)) == 0
+            && std::memcmp(t.magic, trailer_magic, sizeof(t.magic)) == 0 && t.block_count > 0
+            && dictionaries_.count(file.dictionary);
+        if (ok) {
+            in.seekg(static_cast<std::streamoff>(t.index_offset));
+            in.read(reinterpret_cast<char*>(file.blocks.data()), t.block_count * sizeof(block_entry));
+            boost::crc_32_type crc;
+            crc.process_bytes(file.blocks.data(), t.block_count * sizeof(block_entry));
+            ok = in && crc.checksum() == t.index_crc;
+        }
+        if (!ok) {
+            std::cerr << "Archive: " << path << " is damaged, skipping" << std::endl;
+            return;
+        }
+        files_.push_back(std::move(file));
+    }
+
+    std::vector<stored_message> read_block(const archive_file& file, const block_entry& block) {
+        std::vector<stored_message> rows;
+        std::string data(block.compressed_size, '\0');
+        std::ifstream in(file.path, std::ios::binary);
+        in.seekg(static_cast<std::streamoff>(block.offset));
+        in.read(data.data(), data.size());
+        boost::crc_32_type crc;
+        crc.process_bytes(data.data(), data.size());
+        std::string raw;
+        if (!in || crc.checksum() != block.crc || !lz_decompress(dictionaries_[file.dictionary], data, block.raw_size, raw)) {
+            std::cerr << "Archive: damaged block in " << file.path << " at offset " << block.offset << std::endl;
+            return rows;
+        }
+        ++metrics.archive_blocks_read;
+        for (std::size_t p = 0; p + sizeof(std::int64_t) + 6 * sizeof(std::uint32_t) <= raw.size();) {
+            stored_message m;
+            std::uint32_t lengths[6];
+            std::memcpy(&m.id, raw.data() + p, sizeof(m.id));
+            std::memcpy(lengths, raw.data() + p + sizeof(m.id), sizeof(lengths));
+            p += sizeof(m.id) + sizeof(lengths);
+            int i = 0;
+            for (std::string* field : { &m.user, &m.type, &m.recipient, &m.file_path, &m.content, &m.timestamp }) {
+                field->assign(raw, p, lengths[i]);
+                p += lengths[i++];
+            }
+            rows.push_back(std::move(m));
+        }
+        return rows;
+    }
+
+    bool begin_file(const std::vector<stored_message>& sample) {
+        if (dictionaries_.empty()) {
+            std::string dict = train_dictionary(sample, dictionary_size);
+            std::string path = (std::filesystem::path(dir_) / "1.dict").string();
+            std::ofstream(path, std::ios::binary).write(dict.data(), dict.size());
+            dictionaries_[1] = std::move(dict);
+            std::cout << "Archive: trained dictionary of " << dictionaries_[1].size() << " bytes" << std::endl;
+        }
+        dictionary_id_ = dictionaries_.rbegin()->first;
+        std::string name = std::to_string(sample.front().id);
+        tmp_path_ = (std::filesystem::path(dir_) / (std::string(20 - name.size(), '0') + name + ".arc.tmp")).string();
+        out_ = std::fopen(tmp_path_.c_str(), "wb");
+        if (!out_) {
+            std::cerr << "Archive: cannot create " << tmp_path_ << std::endl;
+            return false;
+        }
+        header h{};
+        std::memcpy(h.magic, header_magic, sizeof(h.magic));
+        h.dictionary = static_cast<std::uint32_t>(dictionary_id_);
+        std::fwrite(&h, sizeof(h), 1, out_);
+        offset_ = sizeof(h);
+        return true;
+    }
+
+    bool write_block() {
+        std::string data = lz_compress(dictionaries_[dictionary_id_], raw_);
+        boost::crc_32_type crc;
+        crc.process_bytes(data.data(), data.size());
+        block_.offset = offset_;
+        block_.compressed_size = static_cast<std::uint32_t>(data.size());
+        block_.raw_size = static_cast<std::uint32_t>(raw_.size());
+        block_.crc = crc.checksum();
+        if (std::fwrite(data.data(), 1, data.size(), out_) != data.size()) {
+            std::cerr << "Archive: write error in " << tmp_path_ << std::endl;
+            return false;
+        }
+        offset_ += data.size();
+        metrics.archive_raw_bytes += raw_.size();
+        metrics.archive_compressed_bytes += data.size();
+        pending_.push_back(block_);
+        block_ = block_entry{};
+        block_count_ = 0;
+        raw_.clear();
+        return true;
+    }
+
+    std::string dir_;
+    std::map<int, std::string> dictionaries_;
+    std::vector<archive_file> files_;
+
+    // Файл, который сейчас пишется
+    std::FILE* out_ = nullptr;
+    std::string tmp_path_;
+    int dictionary_id_ = 0;
+    std::uint64_t offset_ = 0;
+    std::vector<block_entry> pending_;
+    block_entry block_;
+    std::size_t block_count_ = 0;
+    std::string raw_;
+    std::int64_t pending_last_ = 0;
+    std::size_t building_rows_ = 0;
+};
+
+// Горячий уровень (SQLite) плюс холодный архив. Сообщения старше порога
+// переносятся migrate(): в архив дописывается файл, и только после его fsync
+// строки удаляются из горячей таблицы. Пока удаление не закончено, часть
+// сообщений есть в обоих уровнях; запросы к архиву поэтому ограничены id
+// ниже самого старого горячего сообщения.
+class tiered_message_store : public message_store {
+public:
+    static constexpr std::size_t max_file_rows = 64 * 1024;
+    // Поиск идёт на потоке ввода-вывода: в архиве он распаковывает не больше
+    // стольких блоков от новых к старым, более старое не ищется
+    static constexpr std::size_t cold_search_blocks = 16;
+
+    tiered_message_store(std::unique_ptr<message_store> hot, std::unique_ptr<archive_tier> cold)
+        : hot_(std::move(hot)), cold_(std::move(cold)) {
+    }
+
+    const char* name() const override {
+        return "sqlite+archive";
+    }
+
+    sqlite3* connection() const override {
+        return hot_->connection();
+    }
+
+    bool append(stored_message& m) override {
+        return hot_->append(m);
+    }
+
+    std::int64_t latest_id() override {
+        return std::max(hot_->latest_id(), cold_->last_id());
+    }
+
+    std::optional<stored_message> get(std::int64_t id) override {
+        if (auto m = hot_->get(id)) {
+            return m;
+        }
+        return id < hot_first_id() ? cold_->get(id) : std::nullopt;
+    }
+
+    std::vector<stored_message> history(std::int64_t before, int limit) override {
+        auto rows = hot_->history(before, limit);
+        fill_from_cold(rows, before, limit, [](const stored_message& m) {
+            return m.recipient.empty();
+            });
+        return rows;
+    }
+
+    std::vector<stored_message> search(const std::string& text, int limit) override {
+        auto rows = hot_->search(text, limit);
+        auto equal = [](char a, char b) {
+            return std::tolower(static_cast<unsigned char>(a)) == std::tolower(static_cast<unsigned char>(b));
+        };
+        fill_from_cold(rows, INT64_MAX, limit, [&](const stored_message& m) {
+            return m.recipient.empty() && std::search(m.content.begin(), m.content.end(), text.begin(), text.end(), equal) != m.content.end();
+            }, std::nullopt, cold_search_blocks);
+        return rows;
+    }
+
+    std::vector<stored_message> conversation(const std::string& a, const std::string& b, int limit) override {
+        auto rows = hot_->conversation(a, b, limit);
+        fill_from_cold(rows, INT64_MAX, limit, [&](const stored_message& m) {
+            return (m.user == a && m.recipient == b) || (m.user == b && m.recipient == a);
+            }, archive_tier::pair_hash(a, b));
+        return rows;
+    }
+
+    std::int64_t count_public_after(std::int64_t after) override {
+        std::int64_t count = hot_->count_public_after(after);
+        std::int64_t first = hot_first_id();
+        if (after + 1 < first) {
+            count += cold_->count_public(after, first - 1);
+        }
+        return count;
+    }
+
+    // Личные сообщения старше порога архива уже не считаются непрочитанными
+    std::vector<std::pair<std::string, std::int64_t>> unread_direct(const std::string& user,
+        const std::function<std::int64_t(const std::string&)>& mark) override {
+        return hot_->unread_direct(user, mark);
+    }
+
+    void sync() override {
+        hot_->sync();
+    }
+
+    // Горячий уровень - по политике целиком, архив - целыми файлами по сроку
+    // Пока пишется файл архива, горячий уровень не чистим: строки из него уже в архиве
+    std::size_t expire(const retention_policy& policy, std::size_t batch, std::vector<std::string>& files) override {
+        if (cold_->building()) {
+            return 0;
+        }
+        if (auto deleted = hot_->expire(policy, batch, files)) {
+            return deleted;
+        }
+        if (policy.max_age.count() <= 0) {
+            return 0;
+        }
+        return cold_->drop_older_than(utc_timestamp(std::time(nullptr) - policy.max_age.count()), files);
+    }
+
+    std::int64_t compact(int pages) override {
+        return hot_->compact(pages);
+    }
+
+    // Шаг переноса: сначала дочищаем горячий уровень от уже заархивированного,
+    // затем дописываем порцию в текущий файл архива. 0 - переносить нечего.
+    std::size_t migrate(const std::string& cutoff, std::size_t batch) {
+        if (!cold_->building()) {
+            if (auto removed = hot_->remove_through(cold_->last_id(), batch)) {
+                metrics.archived_messages += removed;
+                return removed;
+            }
+        }
+        auto rows = hot_->oldest(cold_->last_added(), cutoff, static_cast<int>(batch));
+        if (!rows.empty()) {
+            if (!cold_->add(rows)) {
+                cold_->abort_file();
+                return 0;
+            }
+            if (cold_->building_rows() < max_file_rows) {
+                return rows.size();
+            }
+        }
+        if (cold_->building()) {
+            return cold_->finish_file() ? 1 : 0;
+        }
+        return 0;
+    }
+
+private:
+    std::int64_t hot_first_id() {
+        auto rows = hot_->oldest(0, "9999", 1);
+        return rows.empty() ? INT64_MAX : rows.front().id;
+    }
+
+    // Добрать до limit из архива: только id ниже и горячей выборки, и горячего уровня
+    template<class Match>
+    void fill_from_cold(std::vector<stored_message>& rows, std::int64_t before, int limit, Match match,
+        std::optional<std::uint64_t> pair = std::nullopt, std::size_t max_blocks = SIZE_MAX) {
+        if (rows.size() >= static_cast<std::size_t>(limit)) {
+            return;
+        }
+        before = std::min(before, hot_first_id());
+        if (!rows.empty()) {
+            before = std::min(before, rows.back().id);
+        }
+        cold_->scan_back(before, [&](stored_message&& m) {
+            if (match(m)) {
+                rows.push_back(std::move(m));
+            }
+            return rows.size() < static_cast<std::size_t>(limit);
+            }, pair, max_blocks);
+    }
+
+    std::unique_ptr<message_store> hot_;
+    std::unique_ptr<archive_tier> cold_;
+};
+
+// Сообщения в N файлах SQLite (WAL), шард выбирается по хэшу отправителя.
+// У каждого шарда свой поток-писатель: append только выдаёт id и ставит
+// сообщение в очередь, писатель забирает всю накопившуюся очередь одной
+// транзакцией. Чтение - на потоке ввода-вывода через отдельное соединение
+// и только зафиксированного: писателя поток ввода-вывода не ждёт (WAL не
+// блокирует читателей). get() смотрит ещё и в очередь, чтобы ссылка на только
+// что загруженный файл открывалась сразу. Очистка по сроку и incremental_vacuum
+// тоже выполняются писателями: здесь только раздаются задания и забираются итоги.
+// Общий чат разложен по всем шардам, запросы опрашивают каждый и сливают по id.
+class sharded_message_store : public message_store {
+public:
+    ~sharded_message_store() override {
+        for (auto& shard : shards_) {
+            {
+                std::lock_guard<std::mutex> lock(shard->mutex);
+                shard->stop = true;
+            }
+            shard->wake.notify_one();
+            if (shard->thread.joinable()) {
+                shard->thread.join();
+            }
+            shard->view.reset();
+            shard->writer_view.reset();
+            sqlite3_close(shard->reader);
+            sqlite3_close(shard->writer);
+        }
+    }
+
+    const char* name() const override {
+        return "sharded";
+    }
+
+    // legacy - messages основной базы: её строки переезжают в шарды, иначе
+    // при переключении движка они бы пропали из истории
+    bool open(const std::string& path_prefix, std::size_t count, message_store& legacy) {
+        next_id_ = legacy.latest_id() + 1;
+        for (std::size_t i = 0; i < count; ++i) {
+            auto shard = std::make_unique<shard_state>();
+            shard->path = path_prefix + std::to_string(i) + ".db";
+            if (!open_shard(*shard)) {
+                return false;
+            }
+            shard->view = std::make_unique<sqlite_message_store>(shard->reader);
+            shard->writer_view = std::make_unique<sqlite_message_store>(shard->writer);
+            shards_.push_back(std::move(shard));
+        }
+        if (!migrate(legacy)) {
+            return false;
+        }
+        for (auto& shard : shards_) {
+            next_id_ = std::max(next_id_, shard->view->latest_id() + 1);
+            shard_state* raw = shard.get();
+            shard->thread = std::thread([raw]() {
+                write_loop(*raw);
+                });
+        }
+        std::cout << "Message shards: " << count << ", next id " << next_id_ << std::endl;
+        return true;
+    }
+
+    bool append(stored_message& m) override {
+        release_lost_files();
+        m.id = next_id_++;
+        m.timestamp = utc_timestamp(std::time(nullptr));
+        shard_state& shard = *shards_[fnv1a(m.user) % shards_.size()];
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.queue.push_back(m);
+            shard.enqueued = m.id;
+        }
+        shard.wake.notify_one();
+        return true;
+    }
+
+    std::int64_t latest_id() override {
+        return next_id_ - 1;
+    }
+
+    // Сначала ещё не записанное: если строки там нет, то к началу чтения
+    // она уже зафиксирована и видна соединению чтения
+    std::optional<stored_message> get(std::int64_t id) override {
+        for (auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            for (const auto* rows : { &shard->queue, &shard->inflight }) {
+                auto it = std::find_if(rows->begin(), rows->end(), [id](const stored_message& m) {
+                    return m.id == id;
+                    });
+                if (it != rows->end()) {
+                    return *it;
+                }
+            }
+        }
+        for (auto& shard : shards_) {
+            if (auto m = shard->view->get(id)) {
+                return m;
+            }
+        }
+        return std::nullopt;
+    }
+
+    std::vector<stored_message> history(std::int64_t before, int limit) override {
+        return merge(limit, [&](message_store& view) {
+            return view.history(before, limit);
+            });
+    }
+
+    std::vector<stored_message> search(const std::string& text, int limit) override {
+        return merge(limit, [&](message_store& view) {
+            return view.search(text, limit);
+            });
+    }
+
+    // Направления переписки лежат в шардах своих отправителей
+    std::vector<stored_message> conversation(const std::string& a, const std::string& b, int limit) override {
+        return merge(limit, [&](message_store& view) {
+            return view.conversation(a, b, limit);
+            });
+    }
+
+    std::int64_t count_public_after(std::int64_t after) override {
+        std::int64_t count = 0;
+        for (auto& shard : shards_) {
+            count += shard->view->count_public_after(after);
+        }
+        return count;
+    }
+
+    std::vector<std::pair<std::string, std::int64_t>> unread_direct(const std::string& user,
+        const std::function<std::int64_t(const std::string&)>& mark) override {
+        std::map<std::string, std::int64_t> by_peer;
+        for (auto& shard : shards_) {
+            for (const auto& [peer, count] : shard->view->unread_direct(user, mark)) {
+                by_peer[peer] += count;
+            }
+        }
+        return { by_peer.begin(), by_peer.end() };
+    }
+
+    // Ждёт, пока писатели запишут всё поставленное (при остановке)
+    void sync() override {
+        for (auto& shard : shards_) {
+            std::unique_lock<std::mutex> lock(shard->mutex);
+            shard->committed_cv.wait(lock, [&shard]() {
+                return shard->committed >= shard->enqueued;
+                });
+        }
+    }
+
+    // max_rows общего чата - на все шарды вместе: в начале прохода писатели
+    // присылают id своих последних max_rows сообщений общего чата, по ним
+    // находится общая граница, и уже с ней шарды удаляют строки
+    std::size_t expire(const retention_policy& policy, std::size_t batch, std::vector<std::string>& files) override {
+        maintenance job;
+        if (policy.max_rows > 0 && !general_through_) {
+            job.what = maintenance::kind::newest_public;
+            job.amount = static_cast<std::size_t>(policy.max_rows) + 1;
+            maintain(job, nullptr);
+            if (maintenance_pending_) {
+                return 0;
+            }
+            general_through_ = 0;
+            if (newest_public_.size() > static_cast<std::size_t>(policy.max_rows)) {
+                auto nth = newest_public_.begin() + policy.max_rows;
+                std::nth_element(newest_public_.begin(), nth, newest_public_.end(), std::greater<>());
+                general_through_ = *nth;
+            }
+            newest_public_.clear();
+        }
+        job.what = maintenance::kind::expire;
+        job.policy = policy;
+        if (policy.max_rows > 0) {
+            job.policy.general_through = general_through_;
+        }
+        job.amount = batch;
+        std::size_t deleted = maintain(job, &files);
+        if (!maintenance_pending_) {
+            general_through_.reset();
+        }
+        return deleted;
+    }
+
+    std::int64_t compact(int pages) override {
+        maintenance job;
+        job.what = maintenance::kind::compact;
+        job.amount = static_cast<std::size_t>(pages);
+        return static_cast<std::int64_t>(maintain(job, nullptr));
+    }
+
+    bool maintenance_pending() override {
+        return maintenance_pending_;
+    }
+
+private:
+    struct maintenance {
+        enum class kind { expire, compact, newest_public } what = kind::expire;
+        retention_policy policy;
+        std::size_t amount = 0;     // строк для expire и newest_public, страниц для compact
+    };
+    enum class job_state { idle, queued, running, done };
+
+    struct shard_state {
+        std::string path;
+        // Объявлена первой: отпускается после закрытия соединений
+        std::optional<boost::interprocess::file_lock> lock;
+        sqlite3* reader = nullptr;  // поток ввода-вывода
+        sqlite3* writer = nullptr;  // поток-писатель
+        std::unique_ptr<sqlite_message_store> view;
+        std::unique_ptr<sqlite_message_store> writer_view;
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable wake;       // в очереди появились сообщения или задание
+        std::condition_variable committed_cv;
+        std::vector<stored_message> queue;
+        // Пачка, которую писатель сейчас пишет; он её только читает,
+        // меняется она под mutex
+        std::vector<stored_message> inflight;
+        std::int64_t enqueued = 0;          // id последнего поставленного в очередь
+        std::int64_t committed = 0;         // id последнего записанного (или отброшенного при ошибке)
+        // Вложения несохранённых сообщений: ссылки на блобы возвращает поток ввода-вывода
+        std::vector<std::string> lost_files;
+        // Задание очистки или сжатия и его итог
+        maintenance job;
+        job_state state = job_state::idle;
+        std::size_t job_result = 0;
+        std::vector<std::string> job_files;
+        std::vector<std::int64_t> job_ids;  // newest_public
+        bool job_more = true;               // в этом проходе у шарда ещё есть работа
+        bool stop = false;
+    };
+
+    static bool open_shard(shard_state& shard) {
+        // Один писатель на шард: после передачи сокета новый процесс ждёт старого,
+        // иначе оба выдавали бы одни и те же id от MAX(id) при запуске
+        if (!lock_exclusive(shard.path + ".lock", shard.lock)) {
+            return false;
+        }
+        for (sqlite3** conn : { &shard.writer, &shard.reader }) {
+            if (sqlite3_open(shard.path.c_str(), conn) != SQLITE_OK) {
+                std::cerr << "Cannot open shard " << shard.path << ": " << sqlite3_errmsg(*conn) << std::endl;
+                return false;
+            }
+            sqlite3_busy_timeout(*conn, 5000);
+        }
+        // Для compact(): у нового файла режим ставится до первой таблицы,
+        // шард, созданный без него, переписывается VACUUM один раз
+        sqlite3_stmt* mode;
+        bool incremental = false;
+        if (sqlite3_prepare_v2(shard.writer, "PRAGMA auto_vacuum;", -1, &mode, nullptr) == SQLITE_OK) {
+            incremental = sqlite3_step(mode) == SQLITE_ROW && sqlite3_column_int(mode, 0) == 2;
+            sqlite3_finalize(mode);
+        }
+        if (!incremental && sqlite3_exec(shard.writer, "PRAGMA auto_vacuum = INCREMENTAL; VACUUM;", 0, 0, 0) != SQLITE_OK) {
+            std::cerr << "SQL error (shard " << shard.path << " auto_vacuum): " << sqlite3_errmsg(shard.writer) << std::endl;
+        }
+        const char* schema = "PRAGMA journal_mode = WAL;"
+            "PRAGMA synchronous = NORMAL;"
+            "CREATE TABLE IF NOT EXISTS messages ("
+            "id INTEGER PRIMARY KEY, "
+            "user TEXT NOT NULL, "
+            "content TEXT, "
+            "type TEXT NOT NULL, "
+            "file_path TEXT, "
+            "timestamp DATETIME DEFAULT CURRENT_TIMESTAMP, "
+            "recipient TEXT);"
+            "CREATE INDEX IF NOT EXISTS idx_messages_dm ON messages (user, recipient, id);"
+            "CREATE INDEX IF NOT EXISTS idx_messages_inbox ON messages (recipient, user);";
+        char* errMsg = 0;
+        if (sqlite3_exec(shard.writer, schema, 0, 0, &errMsg) != SQLITE_OK) {
+            std::cerr << "SQL error (shard " << shard.path << "): " << errMsg << std::endl;
+            sqlite3_free(errMsg);
+            return false;
+        }
+        return true;
+    }
+
+    static void write_loop(shard_state& shard) {
+        for (;;) {
+            bool has_batch = false;
+            bool has_job = false;
+            {
+                std::unique_lock<std::mutex> lock(shard.mutex);
+                shard.wake.wait(lock, [&shard]() {
+                    return shard.stop || !shard.queue.empty() || shard.state == job_state::queued;
+                    });
+                has_batch = !shard.queue.empty();
+                has_job = shard.state == job_state::queued;
+                if (!has_batch && !has_job) {
+                    return;
+                }
+                if (has_batch) {
+                    shard.inflight.swap(shard.queue);
+                }
+                if (has_job) {
+                    shard.state = job_state::running;
+                }
+            }
+            if (has_batch) {
+                write_batch(shard);
+            }
+            if (has_job) {
+                std::size_t result = 0;
+                std::vector<std::string> files;
+                std::vector<std::int64_t> ids;
+                if (shard.job.what == maintenance::kind::expire) {
+                    result = shard.writer_view->expire(shard.job.policy, shard.job.amount, files);
+                }
+                else if (shard.job.what == maintenance::kind::newest_public) {
+                    ids = shard.writer_view->newest_public_ids(static_cast<std::int64_t>(shard.job.amount));
+                }
+                else {
+                    result = static_cast<std::size_t>(shard.writer_view->compact(static_cast<int>(shard.job.amount)));
+                }
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                shard.job_result = result;
+                shard.job_files = std::move(files);
+                shard.job_ids = std::move(ids);
+                shard.state = job_state::done;
+            }
+        }
+    }
+
+    // Одна транзакция на все rows; failed - строки, которые не записались.
+    // skip_existing: строка с уже занятым id не ошибка (повтор переноса)
+    static bool insert_rows(shard_state& shard, const std::vector<stored_message>& rows,
+        std::vector<bool>& failed, bool skip_existing) {
+        std::string sql = std::string(skip_existing ? "INSERT OR IGNORE" : "INSERT")
+            + " INTO messages (id, user, content, type, recipient, file_path, timestamp) "
+            "VALUES (?, ?, ?, ?, ?, ?, ?);";
+        failed.assign(rows.size(), false);
+        sqlite3_stmt* stmt;
+        bool ok = sqlite3_prepare_v2(shard.writer, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK;
+        if (ok) {
+            sqlite3_exec(shard.writer, "BEGIN;", 0, 0, 0);
+            for (std::size_t i = 0; i < rows.size(); ++i) {
+                const auto& m = rows[i];
+                auto bind_optional = [stmt](int i, const std::string& value) {
+                    if (value.empty()) {
+                        sqlite3_bind_null(stmt, i);
+                    }
+                    else {
+                        sqlite3_bind_text(stmt, i, value.c_str(), static_cast<int>(value.size()), SQLITE_STATIC);
+                    }
+                };
+                sqlite3_bind_int64(stmt, 1, m.id);
+                sqlite3_bind_text(stmt, 2, m.user.c_str(), static_cast<int>(m.user.size()), SQLITE_STATIC);
+                sqlite3_bind_text(stmt, 3, m.content.c_str(), static_cast<int>(m.content.size()), SQLITE_STATIC);
+                sqlite3_bind_text(stmt, 4, m.type.c_str(), static_cast<int>(m.type.size()), SQLITE_STATIC);
+                bind_optional(5, m.recipient);
+                bind_optional(6, m.file_path);
+                sqlite3_bind_text(stmt, 7, m.timestamp.c_str(), static_cast<int>(m.timestamp.size()), SQLITE_STATIC);
+                // Ошибка строки откатывает только её, остальная пачка пишется дальше
+                if (sqlite3_step(stmt) != SQLITE_DONE) {
+                    std::cerr << "SQL insert error (shard " << shard.path << ", id " << m.id << "): "
+                        << sqlite3_errmsg(shard.writer) << ", message lost" << std::endl;
+                    ++metrics.shard_write_errors;
+                    failed[i] = true;
+                }
+                sqlite3_reset(stmt);
+            }
+            sqlite3_finalize(stmt);
+            ok = sqlite3_exec(shard.writer, "COMMIT;", 0, 0, 0) == SQLITE_OK;
+            if (!ok) {
+                sqlite3_exec(shard.writer, "ROLLBACK;", 0, 0, 0);
+            }
+        }
+        return ok;
+    }
+
+    static void write_batch(shard_state& shard) {
+        const auto& batch = shard.inflight;
+        std::vector<bool> failed;
+        bool ok = insert_rows(shard, batch, failed, false);
+        std::size_t written = std::count(failed.begin(), failed.end(), false);
+        if (ok) {
+            ++metrics.shard_commits;
+            metrics.shard_rows += written;
+        }
+        else {
+            std::cerr << "SQL commit error (shard " << shard.path << "): " << sqlite3_errmsg(shard.writer)
+                << ", " << written << " messages lost" << std::endl;
+            metrics.shard_write_errors += written;
+        }
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.committed = batch.back().id;
+            for (std::size_t i = 0; i < batch.size(); ++i) {
+                if ((!ok || failed[i]) && !batch[i].file_path.empty()) {
+                    shard.lost_files.push_back(batch[i].file_path);
+                }
+            }
+            shard.inflight.clear();
+        }
+        shard.committed_cv.notify_all();
+    }
+
+    // Переносит строки порциями по id: сначала запись в шарды, потом удаление
+    // из основной базы, так что прерванный перенос просто продолжится при запуске
+    bool migrate(message_store& legacy) {
+        constexpr int batch = 1000;
+        std::size_t moved = 0;
+        for (;;) {
+            // Граница по времени позже любой метки: берутся все строки подряд
+            auto rows = legacy.oldest(0, "9999", batch);
+            if (rows.empty()) {
+                break;
+            }
+            std::int64_t last_id = rows.back().id;
+            std::vector<std::vector<stored_message>> parts(shards_.size());
+            for (auto& m : rows) {
+                parts[fnv1a(m.user) % shards_.size()].push_back(std::move(m));
+            }
+            for (std::size_t i = 0; i < shards_.size(); ++i) {
+                std::vector<bool> failed;
+                if (!parts[i].empty() && (!insert_rows(*shards_[i], parts[i], failed, true)
+                    || std::find(failed.begin(), failed.end(), true) != failed.end())) {
+                    std::cerr << "Cannot move messages from the main database into " << shards_[i]->path
+                        << ", not starting" << std::endl;
+                    return false;
+                }
+            }
+            while (legacy.remove_through(last_id, batch) > 0) {
+            }
+            moved += rows.size();
+        }
+        if (moved > 0) {
+            std::cout << "Moved " << moved << " messages from the main database into shards" << std::endl;
+        }
+        return true;
+    }
+
+    // Раздаёт задание шардам, у которых в этом проходе ещё есть работа, и
+    // собирает итоги готовых. Когда все закончили, следующий вызов начинает
+    // проход заново (следующая фаза или цикл retention_job).
+    std::size_t maintain(const maintenance& job, std::vector<std::string>* files) {
+        std::size_t done = 0;
+        maintenance_pending_ = false;
+        for (auto& shard : shards_) {
+            bool posted = false;
+            {
+                std::lock_guard<std::mutex> lock(shard->mutex);
+                if (shard->state == job_state::done) {
+                    done += shard->job_result;
+                    shard->job_more = shard->job_result > 0;
+                    if (files) {
+                        files->insert(files->end(), std::make_move_iterator(shard->job_files.begin()),
+                            std::make_move_iterator(shard->job_files.end()));
+                    }
+                    shard->job_files.clear();
+                    newest_public_.insert(newest_public_.end(), shard->job_ids.begin(), shard->job_ids.end());
+                    shard->job_ids.clear();
+                    shard->state = job_state::idle;
+                }
+                if (shard->state == job_state::idle && shard->job_more) {
+                    shard->job = job;
+                    shard->state = job_state::queued;
+                    posted = true;
+                }
+                maintenance_pending_ = maintenance_pending_ || shard->state != job_state::idle;
+            }
+            if (posted) {
+                shard->wake.notify_one();
+            }
+        }
+        if (!maintenance_pending_) {
+            for (auto& shard : shards_) {
+                std::lock_guard<std::mutex> lock(shard->mutex);
+                shard->job_more = true;
+            }
+        }
+        return done;
+    }
+
+    void release_lost_files() {
+        for (auto& shard : shards_) {
+            std::vector<std::string> lost;
+            {
+                std::lock_guard<std::mutex> lock(shard->mutex);
+                lost.swap(shard->lost_files);
+            }
+            for (const auto& path : lost) {
+                blobs.release(std::filesystem::path(path).filename().string());
+            }
+        }
+    }
+
+    template<class Query>
+    std::vector<stored_message> merge(int limit, Query query) {
+        std::vector<stored_message> rows;
+        for (auto& shard : shards_) {
+            auto part = query(*shard->view);
+            rows.insert(rows.end(), std::make_move_iterator(part.begin()), std::make_move_iterator(part.end()));
+        }
+        std::sort(rows.begin(), rows.end(), [](const stored_message& a, const stored_message& b) {
+            return a.id > b.id;
+            });
+        if (rows.size() > static_cast<std::size_t>(limit)) {
+            rows.resize(limit);
+        }
+        return rows;
+    }
+
+    std::vector<std::unique_ptr<shard_state>> shards_;
+    std::int64_t next_id_ = 1;
+    bool maintenance_pending_ = false;
+    std::vector<std::int64_t> newest_public_;   // собранные ответы newest_public
+    std::optional<std::int64_t> general_through_;  // граница общего чата на текущий проход
+};
+
+std::unique_ptr<message_store> store;
+
+// Фоновая очистка по retention_policy. Каждый шаг - одна короткая порция
+// удалений; размер порции подстраивается так, чтобы шаг (и блокировка записи
+// в SQLite) укладывался в step_budget. Между шагами цикл событий свободен.
+// После удалений файл базы ужимается incremental_vacuum такими же порциями.
+class retention_job {
+public:
+    using clock = std::chrono::steady_clock;
+    static constexpr std::chrono::milliseconds step_budget{ 5 };
+    static constexpr std::chrono::milliseconds step_pause{ 20 };
+    static constexpr std::chrono::minutes cycle_interval{ 10 };
+    static constexpr std::size_t min_batch = 16;
+    static constexpr std::size_t max_batch = 2048;
+    static constexpr int vacuum_pages = 64;
+
+    // Повторный вызов (SIGHUP) только меняет политику, цикл подхватит её на следующем шаге
+    void start(const retention_policy& policy) {
+        policy_ = policy;
+        if (!policy_.enabled()) {
+            return;
+        }
+        std::cout << "Retention: max age " << policy_.max_age.count() << " s, max rows per room "
+            << policy_.max_rows << std::endl;
+        if (running_) {
+            return;
+        }
+        running_ = true;
+        timers.schedule(step_pause, [this]() {
+            step();
+            });
+    }
+
+private:
+    void step() {
+        auto begin = clock::now();
+        std::vector<std::string> files;
+        std::size_t deleted = store->expire(policy_, batch_, files);
+        for (const auto& path : files) {
+            blobs.release(std::filesystem::path(path).filename().string());
+        }
+        adapt(clock::now() - begin);
+        metrics.retention_rows_deleted += deleted;
+        released_ += files.size();
+        bool more = deleted > 0 || store->maintenance_pending();
+        timers.schedule(step_pause, [this, more]() {
+            more ? step() : compact();
+            });
+    }
+
+    void compact() {
+        auto begin = clock::now();
+        std::int64_t freed = store->compact(vacuum_pages);
+        adapt(clock::now() - begin);
+        metrics.retention_pages_freed += freed;
+        if (freed > 0 || store->maintenance_pending()) {
+            timers.schedule(step_pause, [this]() {
+                compact();
+                });
+            return;
+        }
+        if (released_ > 0) {
+            blobs.collect();
+            released_ = 0;
+        }
+        timers.schedule(cycle_interval, [this]() {
+            step();
+            });
+    }
+
+    void adapt(clock::duration took) {
+        auto us = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(took).count());
+        if (us > metrics.retention_step_max_us) {
+            metrics.retention_step_max_us = us;
+        }
+        if (took > step_budget) {
+            batch_ = std::max(batch_ / 2, min_batch);
+        }
+        else if (took < step_budget / 4) {
+            batch_ = std::min(batch_ * 2, max_batch);
+        }
+    }
+
+    retention_policy policy_;
+    bool running_ = false;
+    std::size_t batch_ = 128;
+    std::size_t released_ = 0;
+};
+retention_job retention;
+
+// Перенос в архив сообщений старше max_age, порциями между паузами
+class archive_job {
+public:
+    static constexpr std::chrono::milliseconds step_pause{ 20 };
+    static constexpr std::chrono::minutes cycle_interval{ 10 };
+    static constexpr std::size_t batch = 512;
+
+    void start(tiered_message_store* tiers, std::chrono::seconds max_age) {
+        tiers_ = tiers;
+        max_age_ = max_age;
+        std::cout << "Archive: messages older than " << max_age_.count() << " s move to cold storage" << std::endl;
+        timers.schedule(step_pause, [this]() {
+            step();
+            });
+    }
+
+private:
+    void step() {
+        auto moved = tiers_->migrate(utc_timestamp(std::time(nullptr) - max_age_.count()), batch);
+        timers.schedule(moved > 0 ? std::chrono::milliseconds(step_pause) : std::chrono::milliseconds(cycle_interval), [this]() {
+            step();
+            });
+    }
+
+    tiered_message_store* tiers_ = nullptr;
+    std::chrono::seconds max_age_{ 0 };
+};
+archive_job archiver;
+
+http_response make_response(const http_request& req, http::status status, std::string body,
+    const char* content_type = "text/plain; charset=utf-8") {
+    http_response res{ status, req.version() };
+    res.set(http::field::server, "Messenger-WebSocket-Server");
+    res.set(http::field::content_type, content_type);
+    res.keep_alive(req.keep_alive());
+    res.body() = std::move(body);
+    res.prepare_payload();
+    return res;
+}
+
+std::string json_escape(const std::string& value) {
+    std::string out;
+    out.reserve(value.size() + 2);
+    for (char c : value) {
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                static const char digits[] = "0123456789abcdef";
+                out += "\\u00";
+                out += digits[(c >> 4) & 0xf];
+                out += digits[c & 0xf];
+            }
+            else {
+                out += c;
+            }
+        }
+    }
+    return out;
+}
+
+// Значение параметра из query string (с декодированием %XX и '+')
+std::optional<std::string> query_param(beast::string_view target, beast::string_view name) {
+    auto query = target.find('?');
+    if (query == beast::string_view::npos) {
+        return std::nullopt;
+    }
+    target.remove_prefix(query + 1);
+    while (!target.empty()) {
+        auto amp = target.find('&');
+        auto pair = target.substr(0, amp);
+        auto eq = pair.find('=');
+        if (pair.substr(0, eq) == name) {
+            std::string value;
+            auto raw = eq == beast::string_view::npos ? beast::string_view{} : pair.substr(eq + 1);
+            for (std::size_t i = 0; i < raw.size(); ++i) {
+                if (raw[i] == '+') {
+                    value += ' ';
+                }
+                else if (raw[i] == '%' && i + 2 < raw.size() && std::isxdigit(static_cast<unsigned char>(raw[i + 1]))
+                    && std::isxdigit(static_cast<unsigned char>(raw[i + 2]))) {
+                    value += static_cast<char>(std::stoi(std::string(raw.substr(i + 1, 2)), nullptr, 16));
+                    i += 2;
+                }
+                else {
+                    value += raw[i];
+                }
+            }
+            return value;
+        }
+        if (amp == beast::string_view::npos) {
+            break;
+        }
+        target.remove_prefix(amp + 1);
+    }
+    return std::nullopt;
+}
+
+// Ответ целиком в памяти либо заголовки + диапазон файла,
+// который http_session отдаёт с диска (на Linux через sendfile)
+struct http_reply {
+    http_response response;
+    std::string file_path;
+    std::uint64_t file_offset = 0;
+    std::uint64_t file_length = 0;
+
+    http_reply() = default;
+    http_reply(http_response res) : response(std::move(res)) {
+    }
+};
+
+// Тело ответа из файла: целиком или один диапазон Range (bytes=a-b, a-, -n).
+// Несколько диапазонов в одном запросе не поддерживаем - отдаём файл целиком.
+void set_file_body(const http_request& req, http_reply& reply, std::string path, std::uint64_t size) {
+    http_response& res = reply.response;
+    res.set(http::field::accept_ranges, "bytes");
+    std::uint64_t first = 0;
+    std::uint64_t length = size;
+    auto field = req[http::field::range];
+    std::string_view range(field.data(), field.size());
+    if (range.substr(0, 6) == "bytes=" && range.find(',') == std::string_view::npos) {
+        range.remove_prefix(6);
+        auto dash = range.find('-');
+        auto digits = [](std::string_view s) {
+            return !s.empty() && s.size() <= 19 && std::all_of(s.begin(), s.end(), [](unsigned char c) { return std::isdigit(c); });
+        };
+        auto from = range.substr(0, dash == std::string_view::npos ? 0 : dash);
+        auto to = dash == std::string_view::npos ? std::string_view() : range.substr(dash + 1);
+        bool valid = dash != std::string_view::npos && (digits(from) || digits(to))
+            && (from.empty() || digits(from)) && (to.empty() || digits(to));
+        if (valid) {
+            std::uint64_t a = from.empty() ? 0 : std::stoull(std::string(from));
+            std::uint64_t b = to.empty() ? 0 : std::stoull(std::string(to));
+            bool satisfiable = from.empty() ? b > 0 && size > 0 : a < size && (to.empty() || a <= b);
+            if (!satisfiable) {
+                res.result(http::status::range_not_satisfiable);
+                res.set(http::field::content_range, "bytes */" + std::to_string(size));
+                res.body().clear();
+                res.content_length(0);
+                return;
+            }
+            if (from.empty()) {
+                first = size - std::min(b, size);
+                length = size - first;
+            }
+            else {
+                first = a;
+                length = (to.empty() ? size - 1 : std::min(b, size - 1)) - a + 1;
+            }
+            res.result(http::status::partial_content);
+            res.set(http::field::content_range, "bytes " + std::to_string(first) + "-"
+                + std::to_string(first + length - 1) + "/" + std::to_string(size));
+        }
+    }
+    res.content_length(length);
+    reply.file_path = std::move(path);
+    reply.file_offset = first;
+    reply.file_length = length;
+}
+
+// Маршрутизация обычных HTTP-запросов (health, metrics, статика)
+class http_router {
+public:
+    using handler = std::function<http_reply(const http_request&)>;
+
+    void add(http::verb method, const std::string& path, handler h) {
+        routes_[key(method, path)] = std::move(h);
+    }
+
+    // Вызывается, если точного маршрута нет (например, раздача статики)
+    void set_fallback(handler h) {
+        fallback_ = std::move(h);
+    }
+
+    http_reply route(const http_request& req) const {
+        bool is_head = req.method() == http::verb::head;
+        http::verb method = is_head ? http::verb::get : req.method();
+        std::string path{ req.target() };
+        auto query = path.find('?');
+        if (query != std::string::npos) {
+            path.resize(query);
+        }
+
+        http_reply reply;
+        auto it = routes_.find(key(method, path));
+        if (it != routes_.end()) {
+            reply = it->second(req);
+        }
+        else if (fallback_ && method == http::verb::get) {
+            reply = fallback_(req);
+        }
+        else {
+            reply = make_response(req, http::status::not_found, "Not found\n");
+        }
+        if (is_head) {
+            // Content-Length уже выставлен, тело не отправляем
+            if (reply.file_path.empty()) {
+                auto length = reply.response.body().size();
+                reply.response.body().clear();
+                reply.response.content_length(length);
+            }
+            reply.file_path.clear();
+        }
+        return reply;
+    }
+
+private:
+    static std::string key(http::verb method, const std::string& path) {
+        return std::string(http::to_string(method)) + " " + path;
+    }
+
+    std::unordered_map<std::string, handler> routes_;
+    handler fallback_;
+};
+http_router router;
+
+std::string to_hex(std::uint64_t value) {
+    static const char digits[] = "0123456789abcdef";
+    std::string out(16, '0');
+    for (int i = 15; i >= 0; --i) {
+        out[i] = digits[value & 0xf];
+        value >>= 4;
+    }
+    return out;
+}
+
+// FNV-1a, для ETag криптостойкость не нужна
+std::uint64_t fnv1a(const char* data, std::size_t size, std::uint64_t hash = 14695981039346656037ull) {
+    for (std::size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// SHA-256 (FIPS 180-4) с потоковым update: вложения хэшируются по мере
+// приёма, без чтения файла заново
+class sha256 {
+public:
+    void update(const void* data, std::size_t size) {
+        auto bytes = static_cast<const unsigned char*>(data);
+        total_ += size;
+        while (size > 0) {
+            std::size_t n = std::min(size, sizeof(block_) - used_);
+            std::copy(bytes, bytes + n, block_ + used_);
+            used_ += n;
+            bytes += n;
+            size -= n;
+            if (used_ == sizeof(block_)) {
+                compress();
+                used_ = 0;
+            }
+        }
+    }
+
+    // Шестнадцатеричный дайджест; после вызова объект не используется
+    std::string finish() {
+        std::uint64_t bits = total_ * 8;
+        unsigned char pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (used_ != 56) {
+            update(&pad, 1);
+        }
+        unsigned char length[8];
+        for (int i = 0; i < 8; ++i) {
+            length[i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+        }
+        update(length, 8);
+        static const char digits[] = "0123456789abcdef";
+        std::string out;
+        for (std::uint32_t word : state_) {
+            for (int shift = 28; shift >= 0; shift -= 4) {
+                out += digits[(word >> shift) & 0xf];
+            }
+        }
+        return out;
+    }
+
+private:
+    static std::uint32_t rotr(std::uint32_t x, int n) {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    void compress() {
+        static const std::uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+        std::uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = std::uint32_t(block_[4 * i]) << 24 | std::uint32_t(block_[4 * i + 1]) << 16
+                | std::uint32_t(block_[4 * i + 2]) << 8 | std::uint32_t(block_[4 * i + 3]);
+        }
+        for (int i = 16; i < 64; ++i) {
+            std::uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            std::uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        std::uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+        std::uint32_t e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+        for (int i = 0; i < 64; ++i) {
+            std::uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            std::uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state_[0] += a;
+        state_[1] += b;
+        state_[2] += c;
+        state_[3] += d;
+        state_[4] += e;
+        state_[5] += f;
+        state_[6] += g;
+        state_[7] += h;
+    }
+
+    std::uint32_t state_[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    unsigned char block_[64];
+    std::size_t used_ = 0;
+    std::uint64_t total_ = 0;
+};
+
+bool is_sha256_hex(std::string_view s) {
+    return s.size() == 64 && std::all_of(s.begin(), s.end(), [](unsigned char c) {
+        return std::isdigit(c) || (c >= 'a' && c <= 'f');
+        });
+}
+
+// Есть ли кодировка в Accept-Encoding (с учётом q=0)
+bool accepts_encoding(beast::string_view header, beast::string_view encoding) {
+    for (auto const& item : http::ext_list{ header }) {
+        if (!beast::iequals(item.first, encoding)) {
+            continue;
+        }
+        for (auto const& param : item.second) {
+            if (beast::iequals(param.first, "q") && std::strtod(std::string(param.second).c_str(), nullptr) <= 0.0) {
+                return false;
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+bool etag_matches(beast::string_view if_none_match, const std::string& etag) {
+    if (if_none_match == "*") {
+        return true;
+    }
+    std::size_t pos = 0;
+    while (pos < if_none_match.size()) {
+        auto comma = if_none_match.find(',', pos);
+        auto item = if_none_match.substr(pos, comma == beast::string_view::npos ? beast::string_view::npos : comma - pos);
+        while (!item.empty() && item.front() == ' ') item.remove_prefix(1);
+        while (!item.empty() && item.back() == ' ') item.remove_suffix(1);
+        // Слабое сравнение, как требует RFC 9110 для If-None-Match
+        if (item.substr(0, 2) == "W/") item.remove_prefix(2);
+        if (item == etag) {
+            return true;
+        }
+        if (comma == beast::string_view::npos) {
+            break;
+        }
+        pos = comma + 1;
+    }
+    return false;
+}
+
+// Статика веб-клиента: читается один раз при старте и отдаётся из памяти.
+// Сжатые варианты берутся из соседних файлов name.gz / name.br.
+class asset_cache {
+    // Файлы крупнее этого порога не держим в памяти, а отдаём через sendfile
+    static constexpr std::uintmax_t max_in_memory_size = 256 * 1024;
+
+    struct variant {
+        const char* encoding = nullptr; // nullptr - без сжатия
+        std::string etag;
+        std::string data;
+        std::string path;               // для больших файлов
+        std::uint64_t size = 0;
+    };
+
+    struct asset {
+        std::string content_type;
+        std::string cache_control;
+        std::vector<variant> variants;  // сначала br, затем gzip, последним исходный файл
+    };
+
+    std::unordered_map<std::string, asset> assets_;
+
+public:
+    void load(const std::filesystem::path& root) {
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(root, ec)) {
+            if (!entry.is_regular_file()) {
+                continue;
+            }
+            const auto& path = entry.path();
+            const char* type = mime_type(path.extension().string());
+            if (!type) {
+                continue;
+            }
+            asset a;
+            a.content_type = type;
+            // html перепроверяется каждый раз, остальное можно кэшировать
+            a.cache_control = path.extension() == ".html" ? "no-cache" : "public, max-age=3600";
+
+            variant identity;
+            if (!load_variant(path, nullptr, identity)) {
+                continue;
+            }
+            for (const char* encoding : { "br", "gzip" }) {
+                auto compressed = path;
+                compressed += std::string(".") + (std::string(encoding) == "gzip" ? "gz" : encoding);
+                variant v;
+                if (std::filesystem::is_regular_file(compressed, ec) && load_variant(compressed, encoding, v)
+                    && v.size < identity.size) {
+                    // Свой ETag у каждого представления
+                    v.etag = identity.etag.substr(0, identity.etag.size() - 1) + "-" + encoding + "\"";
+                    a.variants.push_back(std::move(v));
+                }
+            }
+            a.variants.push_back(std::move(identity));
+
+            std::string name = "/" + path.filename().string();
+            std::cout << "Static asset loaded: " << name << " (" << a.variants.size() << " variant(s))" << std::endl;
+            if (name == "/index.html") {
+                assets_["/"] = a;
+            }
+            assets_[name] = std::move(a);
+        }
+        if (ec) {
+            std::cerr << "Cannot read web root " << root << ": " << ec.message() << std::endl;
+        }
+    }
+
+    http_reply serve(const http_request& req) const {
+        std::string path{ req.target() };
+        auto query = path.find('?');
+        if (query != std::string::npos) {
+            path.resize(query);
+        }
+        auto it = assets_.find(path);
+        if (it == assets_.end()) {
+            return make_response(req, http::status::not_found, "Not found\n");
+        }
+        const asset& a = it->second;
+        const variant* chosen = &a.variants.back();
+        for (const auto& v : a.variants) {
+            if (!v.encoding || accepts_encoding(req[http::field::accept_encoding], v.encoding)) {
+                chosen = &v;
+                break;
+            }
+        }
+
+        ++metrics.static_hits;
+        http_reply reply;
+        http_response& res = reply.response;
+        res.version(req.version());
+        res.keep_alive(req.keep_alive());
+        res.set(http::field::server, "Messenger-WebSocket-Server");
+        res.set(http::field::etag, chosen->etag);
+        res.set(http::field::cache_control, a.cache_control);
+        if (a.variants.size() > 1) {
+            res.set(http::field::vary, "Accept-Encoding");
+        }
+
+        auto if_none_match = req[http::field::if_none_match];
+        if (!if_none_match.empty() && etag_matches(if_none_match, chosen->etag)) {
+            ++metrics.static_not_modified;
+            res.result(http::status::not_modified);
+            return reply;
+        }
+
+        res.result(http::status::ok);
+        res.set(http::field::content_type, a.content_type);
+        if (chosen->encoding) {
+            res.set(http::field::content_encoding, chosen->encoding);
+        }
+        if (chosen->path.empty()) {
+            res.body() = chosen->data;
+            res.prepare_payload();
+        }
+        else {
+            set_file_body(req, reply, chosen->path, chosen->size);
+        }
+        return reply;
+    }
+
+private:
+    static const char* mime_type(const std::string& ext) {
+        if (ext == ".html" || ext == ".htm") return "text/html; charset=utf-8";
+        if (ext == ".js") return "application/javascript; charset=utf-8";
+        if (ext == ".css") return "text/css; charset=utf-8";
+        if (ext == ".json") return "application/json";
+        if (ext == ".svg") return "image/svg+xml";
+        if (ext == ".png") return "image/png";
+        if (ext == ".jpg" || ext == ".jpeg") return "image/jpeg";
+        if (ext == ".ico") return "image/x-icon";
+        if (ext == ".txt") return "text/plain; charset=utf-8";
+        return nullptr;
+    }
+
+    static bool load_variant(const std::filesystem::path& path, const char* encoding, variant& v) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            std::cerr << "Cannot open static asset " << path << std::endl;
+            return false;
+        }
+        std::error_code ec;
+        auto size = std::filesystem::file_size(path, ec);
+        if (ec) {
+            return false;
+        }
+        v.encoding = encoding;
+        v.size = size;
+        std::uint64_t hash = 14695981039346656037ull;
+        if (size <= max_in_memory_size) {
+            v.data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            v.size = v.data.size();
+            hash = fnv1a(v.data.data(), v.data.size());
+        }
+        else {
+            // Большой файл: считаем хэш потоком и запоминаем только путь
+            std::vector<char> chunk(64 * 1024);
+            while (in.read(chunk.data(), chunk.size()) || in.gcount() > 0) {
+                hash = fnv1a(chunk.data(), static_cast<std::size_t>(in.gcount()), hash);
+            }
+            v.path = path.string();
+        }
+        v.etag = "\"" + to_hex(hash) + "\"";
+        return true;
+    }
+};
+asset_cache assets;
+
+// Общая часть WebSocket-сессии: протокол чата, очередь отправки, таймауты.
+// Операции над самим потоком реализует websocket_session<Stream> (TCP или TLS).
+class session : public std::enable_shared_from_this<session> {
+protected:
+    // Арена соединения для очереди отправки.
+    // Объявлена первой, чтобы пережить всё, что из неё выделено.
+    std::pmr::unsynchronized_pool_resource arena_{ &arena_blocks };
+    beast::basic_flat_buffer<read_buffer_allocator<char>> buffer_;
+    std::string user_login_;
+    sqlite3* db_;
+    std::queue<std::pmr::string, std::pmr::deque<std::pmr::string>> write_queue_{ std::pmr::deque<std::pmr::string>(&arena_) };
+    bool is_writing_ = false;
+    bool throttle_notified_ = false;
+    admission_control::slot slot_;
+    // Таймауты ведёт общее колесо timers, а не websocket::stream
+    bool accepted_ = false;
+    bool ping_outstanding_ = false;
+    timer_wheel::clock::time_point last_activity_ = timer_wheel::clock::now();
+    timer_wheel::id_type handshake_timer_ = 0;
+    bool draining_ = false;
+    bool closing_ = false;
+    // Эфемерные события (набор текста, курсор): последнее значение каждого
+    // вида за окно, в базу не пишутся
+    std::map<std::string, std::string> pending_events_;
+    bool events_scheduled_ = false;
+    // Приём файла: каждый бинарный кадр (до read_message_max) сразу
+    // дописывается на диск, в buffer_ никогда не лежит больше одного куска
+    struct upload_state {
+        beast::file file;
+        std::string name;
+        std::string path;
+        std::uint64_t expected = 0;
+        std::uint64_t received = 0;
+        sha256 hash;
+        std::string declared_hash; // из команды upload, если клиент его знает
+    };
+    std::unique_ptr<upload_state> upload_;
+
+public:
+    session(sqlite3* db, admission_control::slot slot)
+        : db_(db), slot_(std::move(slot)) {
+        ++metrics.websocket_sessions;
+        std::cout << "Session created" << std::endl;
+    }
+
+    virtual ~session() {
+        live_sessions.erase(this);
+        keepalive.remove(this);
+        forget_login();
+        abort_upload();
+        --metrics.websocket_sessions;
+    }
+
+    // Плавное закрытие при остановке сервера: дописываем очередь отправки
+    // и закрываем с кодом 1012, чтобы клиент переподключился
+    void drain(std::chrono::milliseconds delay) {
+        timers.schedule(delay, [self = shared_from_this()]() {
+            self->draining_ = true;
+            if (!self->is_writing_) {
+                self->close_for_restart();
+            }
+            });
+    }
+
+    void write_message(std::string_view message) {
+        if (closing_) {
+            return;
+        }
+        write_queue_.emplace(message);
+        if (!is_writing_) {
+            do_write();
+        }
+    }
+
+    // Первое, что теряется при медленном клиенте: если в очереди отправки уже
+    // ephemeral_backlog сообщений, событие отбрасывается - клиент и так не успевает читать чат
+    void write_ephemeral(std::string_view message) {
+        if (write_queue_.size() >= config.ephemeral_backlog) {
+            ++metrics.ephemeral_dropped;
+            return;
+        }
+        write_message(message);
+    }
+
+protected:
+    // Чтение очередного куска кадра в buffer_, по завершении - on_read
+    virtual void async_read_frame() = 0;
+    // Отправка write_queue_.front(), по завершении - on_write
+    virtual void async_write_front() = 0;
+    virtual void async_ping() = 0;
+    virtual void async_close(websocket::close_reason reason) = 0;
+    virtual bool is_open() const = 0;
+    // Последнее прочитанное сообщение было бинарным
+    virtual bool got_binary() const = 0;
+    // Жёсткое закрытие: незавершённые операции завершатся с ошибкой
+    virtual void drop() = 0;
+
+    void on_accept(beast::error_code ec) {
+        timers.cancel(handshake_timer_);
+        if (!ec) {
+            std::cout << "Client connected via WebSocket!" << std::endl;
+            accepted_ = true;
+            touch();
+            keepalive.add(this);
+            read();
+        }
+        else {
+            std::cerr << "Async accept error: " << ec.message() << " (code: " << ec.value() << ")" << std::endl;
+        }
+    }
+
+    void touch() {
+        last_activity_ = timer_wheel::clock::now();
+        ping_outstanding_ = false;
+    }
+
+public:
+    // Как keepalive в Beast: после половины idle_timeout тишины шлём ping,
+    // если и после него за ту же половину ничего не пришло - закрываем.
+    // Вызывается keepalive_sweeper раз в полупериод.
+    void check_keepalive(timer_wheel::clock::time_point now) {
+        if (closing_ || !is_open() || now - last_activity_ < config.idle_timeout / 2) {
+            return;
+        }
+        if (ping_outstanding_) {
+            ++metrics.idle_timeouts;
+            std::cerr << "WebSocket idle timeout" << std::endl;
+            drop();
+            return;
+        }
+        ping_outstanding_ = true;
+        ++metrics.keepalive_pings;
+        async_ping();
+    }
+
+    bool authenticated() const {
+        return !user_login_.empty();
+    }
+    bool closing() const {
+        return closing_;
+    }
+    timer_wheel::clock::time_point last_activity() const {
+        return last_activity_;
+    }
+
+    // Сброс под нехваткой памяти: код 1013, клиент переподключится позже
+    void shed() {
+        if (closing_) {
+            return;
+        }
+        closing_ = true;
+        unlist();
+        if (!accepted_ || is_writing_) {
+            drop();
+            return;
+        }
+        async_close(websocket::close_reason(websocket::close_code::try_again_later, "Server busy, reconnect later"));
+    }
+
+protected:
+    void close_for_restart() {
+        if (closing_) {
+            return;
+        }
+        closing_ = true;
+        unlist();
+        if (!accepted_) {
+            drop();
+            return;
+        }
+        async_close(websocket::close_reason(websocket::close_code::service_restart, "Server restarting, reconnect"));
+    }
+
+    bool register_user(std::string_view login, std::string_view password) {
+        switch (accounts->add(login, hash_password(password))) {
+        case user_store::add_result::created:
+            std::cout << "User registered: " << login << std::endl;
+            return true;
+        case user_store::add_result::exists:
+            write_message("System: Registration failed - login already exists");
+            return false;
+        default:
+            return false;
+        }
+    }
+
+    bool authenticate_user(std::string_view login, std::string_view password) {
+        switch (accounts->check(login, hash_password(password))) {
+        case user_store::check_result::ok:
+            std::cout << "User authenticated: " << login << std::endl;
+            return true;
+        case user_store::check_result::wrong_password:
+            std::cerr << "Authentication failed: incorrect password for " << login << std::endl;
+            return false;
+        default:
+            std::cerr << "Authentication failed: user " << login << " not found" << std::endl;
+            return false;
+        }
+    }
 
-class session : public std::enable_shared_from_this<session> {
-    websocket::stream<tcp::socket> ws_;
-    beast::flat_buffer buffer_;
-    std::string user_login_;
-    sqlite3* db_;
-    std::queue<std::string> write_queue_;
-    bool is_writing_ = false;
+    bool user_exists(std::string_view login) {
+        return accounts->exists(login);
+    }
+
+    // Пустой recipient - сообщение в общий чат, иначе личное
+    bool save_message(std::string_view user, std::string_view content, std::string_view recipient = {}) {
+        stored_message m;
+        m.user = user;
+        m.content = content;
+        m.type = recipient.empty() ? "text" : "dm";
+        m.recipient = recipient;
+        if (!store->append(m)) {
+            return false;
+        }
+        receipts.note_message(m.id);
+        std::cout << "Message saved: " << user << ": " << content << std::endl;
+        return true;
+    }
+
+    // Файл - обычное сообщение type='file': content - имя, file_path - путь на диске
+    std::int64_t save_file(std::string_view user, std::string_view name, const std::string& path) {
+        stored_message m;
+        m.user = user;
+        m.content = name;
+        m.type = "file";
+        m.file_path = path;
+        if (!store->append(m)) {
+            return 0;
+        }
+        receipts.note_message(m.id);
+        std::cout << "File saved: " << user << ": " << name << " -> " << path << std::endl;
+        return m.id;
+    }
+
+    // Последние 50 личных сообщений с peer
+    void send_dm_history(std::string_view peer) {
+        auto rows = store->conversation(user_login_, std::string(peer), 50);
+        for (auto it = rows.rbegin(); it != rows.rend(); ++it) {
+            write_message(it->user == user_login_
+                ? "DM to " + it->recipient + ": " + it->content
+                : "DM from " + it->user + ": " + it->content);
+        }
+    }
+
+    std::string hash_password(std::string_view password) {
+        // Заглушка для хэширования
+        return std::string(password) + "_hashed"; // В будущем замени на SHA-256 или bcrypt
+    }
+
+    void do_write() {
+        if (write_queue_.empty()) {
+            is_writing_ = false;
+            if (draining_) {
+                close_for_restart();
+            }
+            return;
+        }
+        is_writing_ = true;
+        // Ссылки на элементы deque не инвалидируются при push в конец,
+        // поэтому пишем прямо из очереди без копии
+        async_write_front();
+    }
+
+    void on_write(beast::error_code ec, std::size_t bytes) {
+        if (ec) {
+            std::cerr << "Write error: " << ec.message() << " (code: " << ec.value() << ")" << std::endl;
+        }
+        else {
+            ++metrics.messages_sent;
+            std::cout << "Wrote " << bytes << " bytes for message: " << write_queue_.front() << std::endl;
+        }
+        write_queue_.pop();
+        do_write();
+    }
+
+    void handle_message(std::string_view msg) {
+        if (msg.find("register:") == 0) {
+            auto pos = msg.find(":", 9);
+            if (pos == std::string::npos) {
+                write_message("System: Invalid registration format");
+                return;
+            }
+            auto login = msg.substr(9, pos - 9);
+            auto password = msg.substr(pos + 1);
+            if (register_user(login, password)) {
+                write_message("System: Registration successful");
+            }
+        }
+        else if (msg.find("login:") == 0) {
+            auto pos = msg.find(":", 6);
+            if (pos == std::string::npos) {
+                write_message("System: Invalid login format");
+                return;
+            }
+            auto login = msg.substr(6, pos - 6);
+            auto password = msg.substr(pos + 1);
+            if (authenticate_user(login, password)) {
+                unlist();
+                user_login_ = login;
+                clients.insert(shared_from_this());
+                auto& sessions = sessions_by_login[user_login_];
+                sessions.insert(this);
+                receipts.load(user_login_);
+                write_message("System: Login successful");
+                if (sessions.size() == 1) {
+                    presence.joined(user_login_);
+                }
+            }
+            else {
+                write_message("System: Login failed");
+            }
+        }
+        else if (msg.find("logout:") == 0) {
+            auto login = msg.substr(7);
+            if (user_login_ == login) {
+                unlist();
+                user_login_.clear();
+                write_message("System: Logout successful");
+                timers.schedule(std::chrono::milliseconds(50), [self = shared_from_this()]() {
+                    self->async_close(websocket::close_code::normal);
+                    });
+            }
+            else {
+                write_message("System: Logout failed - invalid user");
+            }
+        }
+        else if (msg.find("dm:") == 0 && !user_login_.empty()) {
+            auto pos = msg.find(":", 3);
+            if (pos == std::string::npos) {
+                write_message("System: Invalid direct message format");
+                return;
+            }
+            if (!allow_message()) {
+                return;
+            }
+            send_direct(msg.substr(3, pos - 3), msg.substr(pos + 1));
+        }
+        else if (msg.find("dmhistory:") == 0 && !user_login_.empty()) {
+            send_dm_history(msg.substr(10));
+        }
+        else if (msg.find("event:") == 0 && !user_login_.empty()) {
+            // event:<вид>:<значение>, например event:typing:1
+            auto pos = msg.find(":", 6);
+            auto kind = msg.substr(6, pos == std::string::npos ? std::string::npos : pos - 6);
+            auto value = pos == std::string::npos ? std::string_view() : msg.substr(pos + 1);
+            bool valid = !kind.empty() && kind.size() <= 32 && value.size() <= 256
+                && std::all_of(kind.begin(), kind.end(), [](unsigned char c) { return std::isalnum(c) || c == '_'; });
+            if (valid) {
+                queue_event(kind, value);
+            }
+        }
+        else if (msg.find("read:") == 0 && !user_login_.empty()) {
+            // read:<комната>[:<id>]; без id - прочитано всё на данный момент
+            auto room = msg.substr(5);
+            std::int64_t id = receipts.latest();
+            if (auto pos = room.find(':'); pos != std::string::npos) {
+                id = std::min<std::int64_t>(std::atoll(std::string(room.substr(pos + 1)).c_str()), id);
+                room = room.substr(0, pos);
+            }
+            mark_read(room, id);
+        }
+        else if (msg == "unread" && !user_login_.empty()) {
+            send_unread();
+        }
+        else if (msg.find("upload:") == 0 && !user_login_.empty()) {
+            // upload:<имя файла>:<размер>[:<sha256>], затем бинарные кадры с содержимым
+            auto pos = msg.rfind(':');
+            auto end = msg.size();
+            std::string_view hash;
+            if (pos > 7 && is_sha256_hex(msg.substr(pos + 1))) {
+                hash = msg.substr(pos + 1);
+                end = pos;
+                pos = msg.rfind(':', pos - 1);
+            }
+            auto size = msg.substr(pos + 1, end - pos - 1);
+            bool valid = pos > 7 && !size.empty() && size.size() <= 19
+                && std::all_of(size.begin(), size.end(), [](unsigned char c) { return std::isdigit(c); });
+            if (!valid) {
+                write_message("System: Invalid upload format");
+                return;
+            }
+            if (!allow_message()) {
+                return;
+            }
+            begin_upload(msg.substr(7, pos - 7), std::stoull(std::string(size)), hash);
+        }
+        else if (msg == "who" && !user_login_.empty()) {
+            auto logins = presence.online();
+            std::string reply = "System: Online (" + std::to_string(logins.size()) + "): ";
+            for (std::size_t i = 0; i < logins.size(); ++i) {
+                reply += (i ? ", " : "") + logins[i];
+            }
+            write_message(reply);
+        }
+        else if (!user_login_.empty()) {
+            if (!allow_message()) {
+                return;
+            }
+            auto pos = msg.find(": ");
+            if (pos != std::string::npos) {
+                auto user = msg.substr(0, pos);
+                auto content = msg.substr(pos + 2);
+                save_message(user, content);
+            }
+            broadcast(msg);
+        }
+        else {
+            write_message("System: Please login first");
+        }
+    }
+
+    bool allow_message() {
+        if (limiter.check(user_login_) != message_limiter::verdict::allowed) {
+            // Отвечаем один раз на серию отброшенных сообщений
+            if (!throttle_notified_) {
+                throttle_notified_ = true;
+                write_message("System: Slow down - message rate limit exceeded");
+            }
+            return false;
+        }
+        throttle_notified_ = false;
+        return true;
+    }
+
+    // Доставка во все сессии получателя и копия во все сессии отправителя;
+    // офлайн-получатель увидит сообщение через dmhistory
+    void send_direct(std::string_view recipient, std::string_view content) {
+        auto to = sessions_by_login.find(std::string(recipient));
+        if (to == sessions_by_login.end() && !user_exists(recipient)) {
+            write_message("System: Unknown user " + std::string(recipient));
+            return;
+        }
+        save_message(user_login_, content, recipient);
+        ++metrics.direct_messages;
+        if (to != sessions_by_login.end()) {
+            std::string delivered = "DM from " + user_login_ + ": " + std::string(content);
+            for (session* s : to->second) {
+                s->write_message(delivered);
+            }
+        }
+        else {
+            write_message("System: " + std::string(recipient) + " is offline, message saved");
+        }
+        std::string echo = "DM to " + std::string(recipient) + ": " + std::string(content);
+        for (session* s : sessions_by_login[user_login_]) {
+            s->write_message(echo);
+        }
+    }
+
+    // Мимо базы и лимитера чата: частоту и так ограничивает окно event_window
+    void queue_event(std::string_view kind, std::string_view value) {
+        ++metrics.ephemeral_received;
+        auto [it, inserted] = pending_events_.try_emplace(std::string(kind), value);
+        if (!inserted) {
+            ++metrics.ephemeral_coalesced;
+            it->second = value;
+        }
+        if (events_scheduled_) {
+            return;
+        }
+        events_scheduled_ = true;
+        timers.schedule(config.event_window, [weak = weak_from_this()]() {
+            if (auto self = weak.lock()) {
+                self->flush_events();
+            }
+            });
+    }
+
+    void flush_events() {
+        events_scheduled_ = false;
+        if (user_login_.empty() || closing_) {
+            pending_events_.clear();
+            return;
+        }
+        for (const auto& [kind, value] : pending_events_) {
+            std::string event = "Event: " + user_login_ + ":" + kind + ":" + value;
+            for (const auto& client : clients) {
+                if (client.get() != this) {
+                    client->write_ephemeral(event);
+                }
+            }
+        }
+        pending_events_.clear();
+    }
+
+    void mark_read(std::string_view room, std::int64_t id) {
+        bool direct = room.size() > 1 && room[0] == '@';
+        // Только существующие комнаты: иначе клиент заводил бы сколько угодно
+        // отметок в памяти и строк read_marks
+        if (room != "general" && !direct) {
+            return;
+        }
+        if (direct) {
+            std::string peer(room.substr(1));
+            if (sessions_by_login.find(peer) == sessions_by_login.end() && !user_exists(peer)) {
+                return;
+            }
+        }
+        if (!receipts.mark(user_login_, room, id)) {
+            return;
+        }
+        // В личной переписке собеседник получает квитанцию эфемерным событием.
+        // В общем чате не рассылаем: это N^2 сообщений на каждую отметку
+        if (!direct) {
+            return;
+        }
+        auto peer = sessions_by_login.find(std::string(room.substr(1)));
+        if (peer != sessions_by_login.end()) {
+            std::string event = "Event: " + user_login_ + ":read:" + std::to_string(id);
+            for (session* s : peer->second) {
+                s->write_ephemeral(event);
+            }
+        }
+    }
+
+    // Непрочитанное - диапазоны id выше отметок, без строк на каждое сообщение
+    void send_unread() {
+        std::string reply = "System: Unread: general "
+            + std::to_string(store->count_public_after(receipts.get(user_login_, "general")));
+        auto direct = store->unread_direct(user_login_, [this](const std::string& peer) {
+            return receipts.get(user_login_, "@" + peer);
+            });
+        for (const auto& [peer, count] : direct) {
+            reply += ", @" + peer + " " + std::to_string(count);
+        }
+        write_message(reply);
+    }
+
+    void begin_upload(std::string_view name, std::uint64_t size, std::string_view declared_hash) {
+        if (upload_) {
+            write_message("System: Upload already in progress");
+            return;
+        }
+        if (size == 0 || size > max_upload_size) {
+            write_message("System: Upload rejected - size must be 1.." + std::to_string(max_upload_size) + " bytes");
+            return;
+        }
+        // Имя только для отображения и Content-Disposition; на диске - своё
+        std::string clean;
+        for (unsigned char c : name.substr(0, 200)) {
+            if (c >= 0x20 && c != '/' && c != '\\' && c != '"') {
+                clean += static_cast<char>(c);
+            }
+        }
+        if (clean.empty()) {
+            clean = "file";
+        }
+        // Такой файл уже есть: передавать содержимое не нужно
+        if (!declared_hash.empty() && blobs.exists(std::string(declared_hash), size)) {
+            ++metrics.uploads_deduplicated;
+            publish_file(clean, std::string(declared_hash), size);
+            return;
+        }
+        static std::uint64_t counter = 0;
+        auto stamp = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        auto state = std::make_unique<upload_state>();
+        state->name = std::move(clean);
+        state->path = (std::filesystem::path(config.upload_dir)
+            / (std::to_string(stamp) + "-" + std::to_string(++counter) + ".part")).string();
+        state->expected = size;
+        state->declared_hash = declared_hash;
+        beast::error_code ec;
+        state->file.open(state->path.c_str(), beast::file_mode::write, ec);
+        if (ec) {
+            ++metrics.uploads_failed;
+            std::cerr << "Cannot create " << state->path << ": " << ec.message() << std::endl;
+            write_message("System: Upload failed");
+            return;
+        }
+        upload_ = std::move(state);
+        write_message("System: Upload ready");
+    }
+
+    void write_upload_chunk(std::string_view chunk) {
+        if (!upload_) {
+            write_message("System: Unexpected binary data");
+            return;
+        }
+        if (chunk.size() > upload_->expected - upload_->received) {
+            abort_upload();
+            write_message("System: Upload failed - more data than announced");
+            return;
+        }
+        beast::error_code ec;
+        upload_->file.write(chunk.data(), chunk.size(), ec);
+        upload_->hash.update(chunk.data(), chunk.size());
+        if (ec) {
+            std::cerr << "Upload write error: " << ec.message() << std::endl;
+            abort_upload();
+            write_message("System: Upload failed");
+            return;
+        }
+        upload_->received += chunk.size();
+        metrics.upload_bytes += chunk.size();
+        if (upload_->received == upload_->expected) {
+            finish_upload();
+        }
+    }
+
+    void finish_upload() {
+        auto state = std::move(upload_);
+        beast::error_code ec;
+        state->file.close(ec);
+        std::string hash = state->hash.finish();
+        std::error_code fs_ec;
+        if (!state->declared_hash.empty() && state->declared_hash != hash) {
+            ++metrics.uploads_failed;
+            std::filesystem::remove(state->path, fs_ec);
+            write_message("System: Upload failed - checksum mismatch");
+            return;
+        }
+        if (blobs.exists(hash, state->expected)) {
+            // Тот же файл уже хранится - копия не нужна
+            ++metrics.uploads_deduplicated;
+            std::filesystem::remove(state->path, fs_ec);
+        }
+        else {
+            std::string blob_path = blobs.path_for(hash);
+            std::filesystem::create_directories(std::filesystem::path(blob_path).parent_path(), fs_ec);
+            std::filesystem::rename(state->path, blob_path, fs_ec);
+            if (fs_ec) {
+                ++metrics.uploads_failed;
+                std::cerr << "Cannot store " << blob_path << ": " << fs_ec.message() << std::endl;
+                std::filesystem::remove(state->path, fs_ec);
+                write_message("System: Upload failed");
+                return;
+            }
+        }
+        publish_file(state->name, hash, state->expected);
+    }
+
+    // Если сообщения лежат в той же базе (sqlite), сообщение о файле и ссылка
+    // на блоб пишутся одной транзакцией. Иначе ссылка фиксируется раньше
+    // сообщения - collect() не удалит файл, на который уже есть сообщение, - и
+    // возвращается, если сообщение не записалось (sharded возвращает её сам,
+    // если строка не записалась уже после append).
+    void publish_file(const std::string& name, const std::string& hash, std::uint64_t size) {
+        bool one_transaction = store->connection() == db_;
+        if (one_transaction) {
+            sqlite3_exec(db_, "BEGIN;", 0, 0, 0);
+        }
+        std::int64_t id = 0;
+        if (blobs.add_ref(hash, size)) {
+            id = save_file(user_login_, name, blobs.path_for(hash));
+            if (id == 0 && !one_transaction) {
+                blobs.release(hash);
+            }
+        }
+        if (one_transaction && sqlite3_exec(db_, id ? "COMMIT;" : "ROLLBACK;", 0, 0, 0) != SQLITE_OK && id) {
+            std::cerr << "SQL commit error (upload): " << sqlite3_errmsg(db_) << std::endl;
+            sqlite3_exec(db_, "ROLLBACK;", 0, 0, 0);
+            id = 0;
+        }
+        if (id == 0) {
+            ++metrics.uploads_failed;
+            write_message("System: Upload failed");
+            return;
+        }
+        ++metrics.uploads_completed;
+        write_message("System: Upload complete");
+        broadcast("File: " + user_login_ + ": " + name + " (" + std::to_string(size)
+            + " bytes) /api/files?id=" + std::to_string(id));
+    }
+
+    // Недокачанный файл удаляется (обрыв соединения, ошибка записи)
+    void abort_upload() {
+        if (!upload_) {
+            return;
+        }
+        ++metrics.uploads_failed;
+        beast::error_code ec;
+        upload_->file.close(ec);
+        std::error_code fs_ec;
+        std::filesystem::remove(upload_->path, fs_ec);
+        upload_.reset();
+    }
+
+    // Сессия перестаёт получать broadcast и личные сообщения
+    void unlist() {
+        clients.erase(shared_from_this());
+        forget_login();
+    }
+
+    void forget_login() {
+        auto it = sessions_by_login.find(user_login_);
+        if (it == sessions_by_login.end()) {
+            return;
+        }
+        it->second.erase(this);
+        if (it->second.empty()) {
+            sessions_by_login.erase(it);
+            presence.left(user_login_);
+        }
+    }
+
+    void read() {
+        std::cout << "Starting async_read..." << std::endl;
+        async_read_frame();
+    }
+
+    void on_read(beast::error_code ec, bool message_done) {
+        std::cout << "Async read callback invoked" << std::endl;
+        if (!ec) {
+            touch();
+        }
+        if (!ec && !message_done) {
+            read();
+            return;
+        }
+        if (!ec) {
+            auto bytes = buffer_.size();
+            std::cout << "Read completed, bytes: " << bytes << std::endl;
+            // Разбираем прямо из буфера, без промежуточной копии
+            auto data = buffer_.data();
+            std::string_view msg(static_cast<const char*>(data.data()), data.size());
+            if (got_binary()) {
+                write_upload_chunk(msg);
+            }
+            else {
+                ++metrics.messages_received;
+                std::cout << "Received message: " << msg << " (" << bytes << " bytes)" << std::endl;
+                handle_message(msg);
+            }
+            // Буфер возвращается в пул: простаивающее соединение его не держит
+            buffer_.consume(buffer_.size());
+            buffer_.shrink_to_fit();
+            read();
+        }
+        else {
+            std::cerr << "Read error: " << ec.message() << " (code: " << ec.value() << ")" << std::endl;
+            unlist();
+            if (closing_) {
+                return;
+            }
+            async_close(websocket::close_code::normal);
+        }
+    }
+
+    void broadcast(std::string_view msg) {
+        std::cout << "Broadcasting message: " << msg << " to " << clients.size() << " clients" << std::endl;
+        for (const auto& client : clients) {
+            client->write_message(msg);
+        }
+    }
+};
+
+void keepalive_sweeper::sweep() {
+    auto now = timer_wheel::clock::now();
+    // check_keepalive() только закрывает сокет, сессии удаляются позже - обход безопасен
+    for (session* s : slices_[next_slice_]) {
+        s->check_keepalive(now);
+    }
+    next_slice_ = (next_slice_ + 1) % slice_count;
+    if (next_slice_ == 0) {
+        limiter.prune();
+    }
+    shed_if_needed();
+    schedule();
+}
+
+void keepalive_sweeper::shed_if_needed() {
+    // Закрытые сессии отдают буферы в кэши, а не системе: их RSS не считаем
+    auto used = []() {
+        std::uint64_t rss = resident_memory();
+        metrics.resident_bytes = rss;
+        std::uint64_t cached = metrics.arena_cached_bytes + metrics.read_buffer_cached_bytes;
+        return rss > cached ? rss - cached : 0;
+    };
+    std::uint64_t limit = config.memory_limit_mb * 1024 * 1024;
+    std::uint64_t memory = used();
+    if (limit == 0 || draining || memory < limit / 10 * 9 || (!shedding_ && memory <= limit)) {
+        shedding_ = false;
+        last_shed_ = 0;
+        return;
+    }
+    shedding_ = true;
+    arena_blocks.release_cached();
+    read_buffers.release_cached();
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+    memory = used();
+    if (memory < limit / 10 * 9) {
+        shedding_ = false;
+        last_shed_ = 0;
+        return;
+    }
+    std::vector<std::shared_ptr<session>> anonymous;
+    std::vector<std::shared_ptr<session>> logged_in;
+    for (session* s : live_sessions) {
+        if (!s->closing()) {
+            (s->authenticated() ? logged_in : anonymous).push_back(s->shared_from_this());
+        }
+    }
+    // Вошедших не трогаем, пока есть невошедшие или прошлый сброс ещё снижает память
+    bool touch_logged_in = anonymous.empty() && (last_shed_ == 0 || memory >= last_shed_);
+    auto& idle = touch_logged_in ? logged_in : anonymous;
+    std::size_t count = std::min(idle.size(), shed_batch);
+    if (count == 0) {
+        return;
+    }
+    std::partial_sort(idle.begin(), idle.begin() + count, idle.end(), [](const auto& a, const auto& b) {
+        return a->last_activity() < b->last_activity();
+        });
+    for (std::size_t i = 0; i < count; ++i) {
+        idle[i]->shed();
+    }
+    last_shed_ = memory;
+    metrics.sessions_shed += count;
+    std::cerr << "Memory " << memory / (1024 * 1024) << " MB over limit, closed " << count
+        << (touch_logged_in ? " idle logged-in sessions" : " idle sessions without login") << std::endl;
+}
+
+// Один кадр на все изменения присутствия за окно
+void presence_tracker::flush() {
+    scheduled_ = false;
+    if (pending_.empty()) {
+        return;
+    }
+    std::string joined;
+    std::string left;
+    for (const auto& [login, online] : pending_) {
+        auto& list = online ? joined : left;
+        list += (list.empty() ? "" : ", ") + login;
+    }
+    pending_.clear();
+    std::string notice = "System: ";
+    if (!joined.empty()) {
+        notice += joined + " joined the chat";
+    }
+    if (!left.empty()) {
+        notice += (joined.empty() ? "" : "; ") + left + " left the chat";
+    }
+    ++metrics.presence_notices;
+    for (const auto& client : clients) {
+        client->write_message(notice);
+    }
+}
+
+template<class Stream>
+class websocket_session final : public session {
+    websocket::stream<Stream> ws_;
 
 public:
-    session(tcp::socket socket, sqlite3* db) : ws_(std::move(socket)), db_(db) {
-        std::cout << "Session created" << std::endl;
+    websocket_session(Stream&& stream, sqlite3* db, admission_control::slot slot)
+        : session(db, std::move(slot)), ws_(std::move(stream)) {
     }
 
-    void start() {
+    // Запрос на апгрейд уже прочитан http_session, повторно не парсим
+    void start(http_request req) {
         std::cout << "Starting WebSocket handshake..." << std::endl;
+        live_sessions.insert(this);
+        beast::get_lowest_layer(ws_).expires_never();
+        ws_.read_message_max(read_buffer_pool::max_block);
+        // Сообщение уходит одним кадром: заголовок и тело одной записью в сокет,
+        // а не кусками по write_buffer_bytes
+        ws_.auto_fragment(false);
+        buffer_.max_size(read_buffer_pool::max_block);
         ws_.set_option(websocket::stream_base::decorator(
             [](websocket::response_type& res) {
                 res.set(http::field::server, "Messenger-WebSocket-Server");
                 std::cout << "Sending WebSocket response headers: " << res << std::endl;
             }));
         ws_.set_option(websocket::stream_base::timeout{
-            std::chrono::seconds(10),
-            std::chrono::seconds(60),
-            true
+            websocket::stream_base::none(),
+            websocket::stream_base::none(),
+            false
             });
-        ws_.async_accept([self = shared_from_this()](beast::error_code ec) {
-            if (!ec) {
-                std::cout << "Client connected via WebSocket!" << std::endl;
-                self->read();
-            }
-            else {
-                std::cerr << "Async accept error: " << ec.message() << " (code: " << ec.value() << ")" << std::endl;
-                self->read_http_request();
+        ws_.control_callback([this](websocket::frame_type, beast::string_view) {
+            touch();
+            });
+        handshake_timer_ = timers.schedule(config.handshake_timeout, [weak = std::weak_ptr<websocket_session>(self_ptr())]() {
+            if (auto self = weak.lock(); self && !self->accepted_) {
+                std::cerr << "WebSocket handshake timeout" << std::endl;
+                self->drop();
             }
             });
+        ws_.async_accept(req, [self = self_ptr()](beast::error_code ec) {
+            self->on_accept(ec);
+            });
     }
 
 private:
-    void read_http_request() {
-        try {
-            http::request<http::string_body> req;
-            http::read(ws_.next_layer(), buffer_, req);
-            std::cout << "Received HTTP request: " << req.method_string() << " " << req.target() << std::endl;
-            http::response<http::empty_body> res{ http::status::not_found, 11 };
-            res.set(http::field::server, "Messenger-WebSocket-Server");
-            res.prepare_payload();
-            http::write(ws_.next_layer(), res);
-        }
-        catch (const beast::system_error& e) {
-            std::cerr << "HTTP read/write error: " << e.what() << " (code: " << e.code().value() << ")" << std::endl;
+    std::shared_ptr<websocket_session> self_ptr() {
+        return std::static_pointer_cast<websocket_session>(shared_from_this());
+    }
+
+    void async_read_frame() override {
+        // Пока кадр не начал приходить, под чтение занят один блок минимального
+        // класса; остаток сообщения дочитывается с автоматическим размером
+        std::size_t limit = buffer_.size() == 0 ? read_buffer_pool::min_block : 0;
+        ws_.async_read_some(buffer_, limit, [self = self_ptr()](beast::error_code ec, std::size_t) {
+            self->on_read(ec, !ec && self->ws_.is_message_done());
+            });
+    }
+
+    void async_write_front() override {
+        ws_.async_write(net::buffer(write_queue_.front()), [self = self_ptr()](beast::error_code ec, std::size_t bytes) {
+            self->on_write(ec, bytes);
+            });
+    }
+
+    void async_ping() override {
+        ws_.async_ping({}, [self = self_ptr()](beast::error_code ec) {
+            if (ec) {
+                std::cerr << "Ping error: " << ec.message() << std::endl;
+            }
+            });
+    }
+
+    void async_close(websocket::close_reason reason) override {
+        ws_.async_close(reason, [self = self_ptr()](beast::error_code ec) {
+            if (ec) {
+                std::cerr << "Close error: " << ec.message() << std::endl;
+            }
+            });
+    }
+
+    bool is_open() const override {
+        return ws_.is_open();
+    }
+
+    bool got_binary() const override {
+        return ws_.got_binary();
+    }
+
+    void drop() override {
+        beast::get_lowest_layer(ws_).close();
+    }
+};
+
+// Обычное HTTP-соединение (открытый TCP или TLS): читает запрос асинхронно
+// и с таймаутом, апгрейдит его до WebSocket или отдаёт ответ через router
+template<class Stream>
+class http_session : public std::enable_shared_from_this<http_session<Stream>> {
+    Stream stream_;
+    beast::flat_buffer buffer_;
+    // Один парсер на соединение, пересоздаётся на месте для каждого запроса
+    std::optional<http::request_parser<http::string_body>> parser_;
+    http_request req_;
+    sqlite3* db_;
+    admission_control::slot slot_;
+
+public:
+    http_session(Stream&& stream, sqlite3* db, admission_control::slot slot)
+        : stream_(std::move(stream)), db_(db), slot_(std::move(slot)) {
+    }
+
+    void start() {
+#ifdef MESSENGER_ENABLE_TLS
+        if constexpr (is_tls_stream<Stream>) {
+            handshake();
+            return;
         }
+#endif
+        read();
+    }
+
+private:
+#ifdef MESSENGER_ENABLE_TLS
+    void handshake() {
+        beast::get_lowest_layer(stream_).expires_after(config.http_timeout);
+        stream_.async_handshake(net::ssl::stream_base::server, [self = this->shared_from_this()](beast::error_code ec) {
+            if (ec) {
+                ++metrics.tls_handshake_errors;
+                std::cerr << "TLS handshake error: " << ec.message() << std::endl;
+                return;
+            }
+            ++metrics.tls_handshakes;
+            if (SSL_session_reused(self->stream_.native_handle())) {
+                ++metrics.tls_resumed;
+            }
+            self->read();
+            });
+    }
+#endif
+
+    void read() {
+        parser_.emplace();
+        parser_->header_limit(8 * 1024);
+        parser_->body_limit(64 * 1024);
+        // Медленный клиент не должен держать соединение вечно
+        beast::get_lowest_layer(stream_).expires_after(config.http_timeout);
+        http::async_read(stream_, buffer_, *parser_, [self = this->shared_from_this()](beast::error_code ec, std::size_t) {
+            self->on_read(ec);
+            });
     }
 
-    bool register_user(const std::string& login, const std::string& password) {
-        std::string hashed_password = hash_password(password);
-        std::string sql = "INSERT INTO users (login, password) VALUES (?, ?);";
-        sqlite3_stmt* stmt;
-        if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-            std::cerr << "SQL prepare error: " << sqlite3_errmsg(db_) << std::endl;
-            return false;
+    void on_read(beast::error_code ec) {
+        if (ec == http::error::end_of_stream) {
+            close();
+            return;
         }
-        sqlite3_bind_text(stmt, 1, login.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, hashed_password.c_str(), -1, SQLITE_STATIC);
-        int rc = sqlite3_step(stmt);
-        if (rc != SQLITE_DONE) {
-            std::string err_msg = sqlite3_errmsg(db_);
-            std::cerr << "SQL insert error: " << err_msg << " (code: " << rc << ")" << std::endl;
-            sqlite3_finalize(stmt);
-            if (rc == SQLITE_CONSTRAINT) {
-                write_message("System: Registration failed - login already exists");
-                return false;
+        if (ec) {
+            if (ec == beast::error::timeout) {
+                ++metrics.http_timeouts;
             }
-            return false;
+            std::cerr << "HTTP read error: " << ec.message() << " (code: " << ec.value() << ")" << std::endl;
+            return;
         }
-        sqlite3_finalize(stmt);
-        std::cout << "User registered: " << login << std::endl;
-        return true;
-    }
 
-    bool authenticate_user(const std::string& login, const std::string& password) {
-        std::string hashed_password = hash_password(password);
-        std::string sql = "SELECT password FROM users WHERE login = ?;";
-        sqlite3_stmt* stmt;
-        if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-            std::cerr << "SQL prepare error: " << sqlite3_errmsg(db_) << std::endl;
-            return false;
+        // Один разбор запроса: либо апгрейд до WebSocket, либо REST/статика
+        if (websocket::is_upgrade(parser_->get())) {
+            std::make_shared<websocket_session<Stream>>(std::move(stream_), db_, std::move(slot_))->start(parser_->release());
+            return;
         }
-        sqlite3_bind_text(stmt, 1, login.c_str(), -1, SQLITE_STATIC);
-        int rc = sqlite3_step(stmt);
-        if (rc == SQLITE_ROW) {
-            std::string stored_password = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
-            sqlite3_finalize(stmt);
-            if (stored_password == hashed_password) {
-                std::cout << "User authenticated: " << login << std::endl;
-                return true;
-            }
-            else {
-                std::cerr << "Authentication failed: incorrect password for " << login << std::endl;
-                return false;
-            }
+        req_ = parser_->release();
+
+        ++metrics.http_requests;
+        std::cout << "Received HTTP request: " << req_.method_string() << " " << req_.target() << std::endl;
+        auto reply = std::make_shared<http_reply>(router.route(req_));
+        if (!reply->file_path.empty()) {
+            write_file(reply);
+            return;
         }
-        sqlite3_finalize(stmt);
-        std::cerr << "Authentication failed: user " << login << " not found" << std::endl;
-        return false;
+        beast::get_lowest_layer(stream_).expires_after(config.http_write_timeout);
+        http::async_write(stream_, reply->response, [self = this->shared_from_this(), reply](beast::error_code ec, std::size_t) {
+            self->on_write(ec, reply->response.need_eof());
+            });
     }
 
-    bool save_message(const std::string& user, const std::string& content) {
-        std::string sql = "INSERT INTO messages (user, content, type) VALUES (?, ?, 'text');";
-        sqlite3_stmt* stmt;
-        if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-            std::cerr << "SQL prepare error (messages): " << sqlite3_errmsg(db_) << std::endl;
-            return false;
+    void on_write(beast::error_code ec, bool need_eof) {
+        if (ec) {
+            if (ec == beast::error::timeout || ec == net::error::operation_aborted) {
+                ++metrics.http_timeouts;
+            }
+            std::cerr << "HTTP write error: " << ec.message() << " (code: " << ec.value() << ")" << std::endl;
+            return;
         }
-        sqlite3_bind_text(stmt, 1, user.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, content.c_str(), -1, SQLITE_STATIC);
-        int rc = sqlite3_step(stmt);
-        if (rc != SQLITE_DONE) {
-            std::cerr << "SQL insert error (messages): " << sqlite3_errmsg(db_) << " (code: " << rc << ")" << std::endl;
-            sqlite3_finalize(stmt);
-            return false;
+        if (need_eof) {
+            close();
+            return;
         }
-        sqlite3_finalize(stmt);
-        std::cout << "Message saved: " << user << ": " << content << std::endl;
-        return true;
+        read();
     }
 
-    std::string hash_password(const std::string& password) {
-        // Заглушка для хэширования
-        return password + "_hashed"; // В будущем замени на SHA-256 или bcrypt
-    }
+    // Тело ответа берётся из файла: заголовки пишет Beast, тело - sendfile
+    // (или кусками там, где sendfile нет), файл целиком в память не читается
+    struct file_transfer {
+        beast::file file;
+        std::uint64_t offset = 0;
+        std::uint64_t remaining = 0;
+        std::vector<char> chunk;
+        std::unique_ptr<net::steady_timer> timer;
+    };
 
-    void write_message(const std::string& message) {
-        write_queue_.push(message);
-        if (!is_writing_) {
-            do_write();
+    void write_file(std::shared_ptr<http_reply> reply) {
+        auto transfer = std::make_shared<file_transfer>();
+        beast::error_code ec;
+        transfer->file.open(reply->file_path.c_str(), beast::file_mode::scan, ec);
+        if (!ec && reply->file_offset > 0) {
+            transfer->file.seek(reply->file_offset, ec);
         }
-    }
-
-    void do_write() {
-        if (write_queue_.empty()) {
-            is_writing_ = false;
+        if (ec) {
+            std::cerr << "Cannot open " << reply->file_path << ": " << ec.message() << std::endl;
+            reply->file_path.clear();
+            reply->response = make_response(req_, http::status::internal_server_error, "Internal server error\n");
+            beast::get_lowest_layer(stream_).expires_after(config.http_write_timeout);
+            http::async_write(stream_, reply->response, [self = this->shared_from_this(), reply](beast::error_code ec, std::size_t) {
+                self->on_write(ec, reply->response.need_eof());
+                });
             return;
         }
-        is_writing_ = true;
-        auto msg = std::make_shared<std::string>(write_queue_.front());
-        ws_.async_write(net::buffer(*msg),
-            [self = shared_from_this(), msg](beast::error_code ec, std::size_t bytes) {
-                if (ec) {
-                    std::cerr << "Write error: " << ec.message() << " (code: " << ec.value() << ")" << std::endl;
-                }
-                else {
-                    std::cout << "Wrote " << bytes << " bytes for message: " << *msg << std::endl;
-                }
-                self->write_queue_.pop();
-                self->do_write();
+        transfer->offset = reply->file_offset;
+        transfer->remaining = reply->file_length;
+
+        auto sr = std::make_shared<http::response_serializer<http::string_body>>(reply->response);
+        beast::get_lowest_layer(stream_).expires_after(config.http_write_timeout);
+        http::async_write_header(stream_, *sr, [self = this->shared_from_this(), reply, sr, transfer](beast::error_code ec, std::size_t) {
+            if (ec) {
+                self->on_write(ec, true);
+                return;
+            }
+            self->write_file_body(transfer, reply->response.need_eof());
             });
     }
 
-    void read() {
-        std::cout << "Starting async_read..." << std::endl;
-        ws_.async_read(buffer_, [self = shared_from_this()](beast::error_code ec, std::size_t bytes) {
-            std::cout << "Async read callback invoked" << std::endl;
-            if (!ec) {
-                std::cout << "Read completed, bytes: " << bytes << std::endl;
-                std::string msg = beast::buffers_to_string(self->buffer_.data());
-                std::cout << "Received message: " << msg << " (" << bytes << " bytes)" << std::endl;
-                self->buffer_.consume(self->buffer_.size());
+    void write_file_body(std::shared_ptr<file_transfer> t, bool need_eof) {
+#ifdef __linux__
+        // sendfile только для открытого TCP: TLS шифрует в пространстве пользователя
+        if constexpr (!is_tls_stream<Stream>) {
+            beast::get_lowest_layer(stream_).expires_never();
+            send_file_body(t, need_eof);
+            return;
+        }
+#endif
+        copy_file_body(t, need_eof);
+    }
 
-                if (msg.find("register:") == 0) {
-                    auto pos = msg.find(":", 9);
-                    if (pos == std::string::npos) {
-                        self->write_message("System: Invalid registration format");
-                        self->read();
-                        return;
-                    }
-                    std::string login = msg.substr(9, pos - 9);
-                    std::string password = msg.substr(pos + 1);
-                    if (self->register_user(login, password)) {
-                        self->write_message("System: Registration successful");
-                    }
-                }
-                else if (msg.find("login:") == 0) {
-                    auto pos = msg.find(":", 6);
-                    if (pos == std::string::npos) {
-                        self->write_message("System: Invalid login format");
-                        self->read();
-                        return;
-                    }
-                    std::string login = msg.substr(6, pos - 6);
-                    std::string password = msg.substr(pos + 1);
-                    if (self->authenticate_user(login, password)) {
-                        self->user_login_ = login;
-                        clients.insert(self);
-                        self->write_message("System: Login successful");
-                        self->broadcast("System: " + login + " joined the chat");
-                    }
-                    else {
-                        self->write_message("System: Login failed");
-                    }
-                }
-                else if (msg.find("logout:") == 0) {
-                    std::string login = msg.substr(7);
-                    if (self->user_login_ == login) {
-                        self->broadcast("System: " + login + " left the chat");
-                        clients.erase(self);
-                        self->user_login_.clear();
-                        self->write_message("System: Logout successful");
-                        auto timer = std::make_shared<net::steady_timer>(self->ws_.get_executor());
-                        timer->expires_after(std::chrono::milliseconds(50));
-                        timer->async_wait([self, timer](beast::error_code ec) {
-                            if (!ec) {
-                                self->ws_.async_close(websocket::close_code::normal, [self](beast::error_code ec) {
-                                    if (ec) {
-                                        std::cerr << "Close error: " << ec.message() << std::endl;
-                                    }
-                                    });
-                            }
-                            });
-                    }
-                    else {
-                        self->write_message("System: Logout failed - invalid user");
-                    }
+#ifdef __linux__
+    void send_file_body(std::shared_ptr<file_transfer> t, bool need_eof) {
+        auto& socket = beast::get_lowest_layer(stream_).socket();
+        beast::error_code ec;
+        socket.native_non_blocking(true, ec);
+        while (!ec && t->remaining > 0) {
+            off_t offset = static_cast<off_t>(t->offset);
+            auto count = static_cast<std::size_t>(std::min<std::uint64_t>(t->remaining, 1 << 20));
+            ssize_t n = ::sendfile(socket.native_handle(), t->file.native_handle(), &offset, count);
+            if (n > 0) {
+                t->offset += static_cast<std::uint64_t>(n);
+                t->remaining -= static_cast<std::uint64_t>(n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // Сокет заполнен: ждём готовности, но не дольше http_write_timeout
+                if (!t->timer) {
+                    t->timer = std::make_unique<net::steady_timer>(socket.get_executor());
                 }
-                else if (!self->user_login_.empty()) {
-                    auto pos = msg.find(": ");
-                    if (pos != std::string::npos) {
-                        std::string user = msg.substr(0, pos);
-                        std::string content = msg.substr(pos + 2);
-                        self->save_message(user, content);
+                t->timer->expires_after(config.http_write_timeout);
+                t->timer->async_wait([self = this->shared_from_this()](beast::error_code ec) {
+                    if (!ec) {
+                        beast::error_code ignored;
+                        beast::get_lowest_layer(self->stream_).socket().cancel(ignored);
                     }
-                    self->broadcast(msg);
-                }
-                else {
-                    self->write_message("System: Please login first");
-                }
-                self->read();
-            }
-            else {
-                std::cerr << "Read error: " << ec.message() << " (code: " << ec.value() << ")" << std::endl;
-                clients.erase(self);
-                self->ws_.async_close(websocket::close_code::normal, [](beast::error_code ec) {
+                    });
+                socket.async_wait(tcp::socket::wait_write, [self = this->shared_from_this(), t, need_eof](beast::error_code ec) {
+                    t->timer->cancel();
                     if (ec) {
-                        std::cerr << "Close error: " << ec.message() << std::endl;
+                        self->on_write(ec, true);
+                        return;
                     }
+                    self->send_file_body(t, need_eof);
                     });
+                return;
+            }
+            // n == 0: файл стал короче, чем обещано в Content-Length
+            ec = n == 0 ? beast::error_code(net::error::eof) : beast::error_code(errno, beast::system_category());
+        }
+        // Соединение после ошибки в середине тела не восстановить
+        on_write(ec, need_eof || ec);
+    }
+#endif
+
+    void copy_file_body(std::shared_ptr<file_transfer> t, bool need_eof) {
+        if (t->remaining == 0) {
+            on_write({}, need_eof);
+            return;
+        }
+        t->chunk.resize(64 * 1024);
+        beast::error_code ec;
+        auto count = static_cast<std::size_t>(std::min<std::uint64_t>(t->remaining, t->chunk.size()));
+        auto n = t->file.read(t->chunk.data(), count, ec);
+        if (!ec && n == 0) {
+            ec = net::error::eof;
+        }
+        if (ec) {
+            on_write(ec, true);
+            return;
+        }
+        t->offset += n;
+        t->remaining -= n;
+        beast::get_lowest_layer(stream_).expires_after(config.http_write_timeout);
+        net::async_write(stream_, net::buffer(t->chunk.data(), n), [self = this->shared_from_this(), t, need_eof](beast::error_code ec, std::size_t) {
+            if (ec) {
+                self->on_write(ec, true);
+                return;
             }
+            self->copy_file_body(t, need_eof);
             });
     }
 
-    void broadcast(const std::string& msg) {
-        std::cout << "Broadcasting message: " << msg << " to " << clients.size() << " clients" << std::endl;
-        for (const auto& client : clients) {
-            client->write_message(msg);
+    void close() {
+        if constexpr (is_tls_stream<Stream>) {
+            beast::get_lowest_layer(stream_).expires_after(config.http_timeout);
+            stream_.async_shutdown([self = this->shared_from_this()](beast::error_code) {
+                });
+        }
+        else {
+            beast::error_code ec;
+            beast::get_lowest_layer(stream_).socket().shutdown(tcp::socket::shutdown_send, ec);
         }
     }
 };
@@ -280,21 +5551,55 @@ class listener : public std::enable_shared_from_this<listener> {
     net::io_context& ioc_;
     tcp::acceptor acceptor_;
     sqlite3* db_;
+    // Переменная окружения, через которую сокет передаётся новому процессу
+    const char* handoff_env_ = "MESSENGER_LISTEN_FD";
+#ifdef MESSENGER_ENABLE_TLS
+    net::ssl::context* tls_ = nullptr;
+#endif
 public:
     listener(net::io_context& ioc, tcp::endpoint endpoint, sqlite3* db)
         : ioc_(ioc), acceptor_(ioc, endpoint), db_(db) {
         std::cout << "Listener created for endpoint " << endpoint << std::endl;
     }
+    // Слушающий сокет, унаследованный от предыдущего процесса при горячем перезапуске
+    listener(net::io_context& ioc, tcp::endpoint endpoint, tcp::acceptor::native_handle_type inherited, sqlite3* db)
+        : ioc_(ioc), acceptor_(ioc, endpoint.protocol(), inherited), db_(db) {
+        std::cout << "Listener adopted inherited socket for endpoint " << endpoint << std::endl;
+    }
     void start() {
         accept();
     }
+    // Перестать принимать соединения; уже открытые не трогаем
+    void stop() {
+        beast::error_code ec;
+        acceptor_.close(ec);
+    }
+    tcp::acceptor::native_handle_type native_handle() {
+        return acceptor_.native_handle();
+    }
+    const char* handoff_env() const {
+        return handoff_env_;
+    }
+    void set_handoff_env(const char* name) {
+        handoff_env_ = name;
+    }
+#ifdef MESSENGER_ENABLE_TLS
+    // Все принятые соединения сначала проходят TLS-рукопожатие
+    void enable_tls(net::ssl::context& ctx) {
+        tls_ = &ctx;
+    }
+#endif
 private:
     void accept() {
         acceptor_.async_accept(ioc_, [self = shared_from_this()](beast::error_code ec, tcp::socket socket) {
+            if (!self->acceptor_.is_open()) {
+                return;
+            }
             if (!ec) {
                 std::cout << "New client accepted" << std::endl;
-                auto sess = std::make_shared<session>(std::move(socket), self->db_);
-                sess->start();
+                ++metrics.connections_accepted;
+                startup.accepted();
+                self->admit(std::move(socket));
             }
             else {
                 std::cerr << "Accept error: " << ec.message() << " (code: " << ec.value() << ")" << std::endl;
@@ -302,59 +5607,649 @@ private:
             self->accept();
             });
     }
+
+    void admit(tcp::socket socket) {
+        beast::error_code ec;
+        auto remote = socket.remote_endpoint(ec);
+        if (ec) {
+            return;
+        }
+        admission_control::slot slot;
+        auto verdict = admission.try_admit(remote.address().to_string(), slot);
+        if (verdict == admission_control::verdict::admitted) {
+#ifdef MESSENGER_ENABLE_TLS
+            if (tls_) {
+                std::make_shared<http_session<tls_stream>>(tls_stream(std::move(socket), *tls_), db_, std::move(slot))->start();
+                return;
+            }
+#endif
+            std::make_shared<http_session<beast::tcp_stream>>(beast::tcp_stream(std::move(socket)), db_, std::move(slot))->start();
+            return;
+        }
+        // Отказ без разбора запроса: один неблокирующий write в пустой
+        // буфер сокета и закрытие
+        static const std::string busy =
+            "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 5\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+        static const std::string too_many =
+            "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 5\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+        const std::string& reply = verdict == admission_control::verdict::too_many_from_ip ? too_many : busy;
+        std::cerr << "Connection from " << remote << " rejected" << std::endl;
+        socket.non_blocking(true, ec);
+        socket.write_some(net::buffer(reply), ec);
+        socket.shutdown(tcp::socket::shutdown_both, ec);
+        socket.close(ec);
+    }
 };
 
-void do_listen(net::io_context& ioc, tcp::endpoint endpoint, sqlite3* db) {
+int limit_param(const http_request& req, int fallback) {
+    auto value = query_param(req.target(), "limit");
+    int limit = value ? std::atoi(value->c_str()) : fallback;
+    return std::clamp(limit, 1, 200);
+}
+
+// Сообщения из хранилища - JSON-массивом
+http_response messages_json(const http_request& req, const std::vector<stored_message>& rows) {
+    std::string body = "[";
+    for (const auto& m : rows) {
+        if (body.size() > 1) {
+            body += ",";
+        }
+        body += "{\"id\":" + std::to_string(m.id)
+            + ",\"user\":\"" + json_escape(m.user)
+            + "\",\"content\":\"" + json_escape(m.content)
+            + "\",\"type\":\"" + json_escape(m.type)
+            + "\",\"timestamp\":\"" + json_escape(m.timestamp) + "\"}";
+    }
+    body += "]";
+    return make_response(req, http::status::ok, body, "application/json");
+}
+
+void register_routes() {
+    router.set_fallback([](const http_request& req) {
+        return assets.serve(req);
+        });
+    router.add(http::verb::get, "/health", [](const http_request& req) {
+        return make_response(req, http::status::ok, "OK\n");
+        });
+    router.add(http::verb::get, "/metrics", [](const http_request& req) {
+        std::ostringstream out;
+        out << "messenger_io_backend{name=\"" << io_backend << "\"} 1\n"
+            << "messenger_startup_milliseconds " << metrics.startup_ms << "\n"
+            << "messenger_time_to_first_accept_milliseconds " << metrics.first_accept_ms << "\n"
+            << "messenger_config_reloads_total{result=\"ok\"} " << metrics.config_reloads << "\n"
+            << "messenger_config_reloads_total{result=\"error\"} " << metrics.config_reload_errors << "\n"
+            << "messenger_connections_accepted_total " << metrics.connections_accepted << "\n"
+            << "messenger_connections_open " << metrics.connections_open << "\n"
+            << "messenger_connections_rejected_total{reason=\"max_connections\"} " << metrics.rejected_max_connections << "\n"
+            << "messenger_connections_rejected_total{reason=\"per_ip\"} " << metrics.rejected_per_ip << "\n"
+            << "messenger_connections_rejected_total{reason=\"accept_rate\"} " << metrics.rejected_accept_rate << "\n"
+            << "messenger_websocket_sessions " << metrics.websocket_sessions << "\n"
+            << "messenger_logged_in_clients " << clients.size() << "\n"
+            << "messenger_http_requests_total " << metrics.http_requests << "\n"
+            << "messenger_http_timeouts_total " << metrics.http_timeouts << "\n"
+            << "messenger_static_hits_total " << metrics.static_hits << "\n"
+            << "messenger_static_not_modified_total " << metrics.static_not_modified << "\n"
+            << "messenger_messages_received_total " << metrics.messages_received << "\n"
+            << "messenger_messages_sent_total " << metrics.messages_sent << "\n"
+            << "messenger_direct_messages_total " << metrics.direct_messages << "\n"
+            << "messenger_users_online " << sessions_by_login.size() << "\n"
+            << "messenger_presence_notices_total " << metrics.presence_notices << "\n"
+            << "messenger_ephemeral_received_total " << metrics.ephemeral_received << "\n"
+            << "messenger_ephemeral_coalesced_total " << metrics.ephemeral_coalesced << "\n"
+            << "messenger_ephemeral_dropped_total " << metrics.ephemeral_dropped << "\n"
+            << "messenger_read_marks_flushed_total " << metrics.read_marks_flushed << "\n"
+            << "messenger_uploads_total{result=\"completed\"} " << metrics.uploads_completed << "\n"
+            << "messenger_uploads_total{result=\"failed\"} " << metrics.uploads_failed << "\n"
+            << "messenger_upload_bytes_total " << metrics.upload_bytes << "\n"
+            << "messenger_uploads_deduplicated_total " << metrics.uploads_deduplicated << "\n"
+            << "messenger_blobs_collected_total " << metrics.blobs_collected << "\n"
+            << "messenger_storage_engine{name=\"" << store->name() << "\"} 1\n"
+            << "messenger_log_appends_total " << metrics.log_appends << "\n"
+            << "messenger_shard_commits_total " << metrics.shard_commits << "\n"
+            << "messenger_shard_rows_total " << metrics.shard_rows << "\n"
+            << "messenger_shard_write_errors_total " << metrics.shard_write_errors << "\n"
+            << "messenger_archived_messages_total " << metrics.archived_messages << "\n"
+            << "messenger_archive_files_written_total " << metrics.archive_files << "\n"
+            << "messenger_archive_raw_bytes_total " << metrics.archive_raw_bytes << "\n"
+            << "messenger_archive_compressed_bytes_total " << metrics.archive_compressed_bytes << "\n"
+            << "messenger_archive_blocks_read_total " << metrics.archive_blocks_read << "\n"
+            << "messenger_retention_rows_deleted_total " << metrics.retention_rows_deleted << "\n"
+            << "messenger_retention_pages_freed_total " << metrics.retention_pages_freed << "\n"
+            << "messenger_retention_step_max_microseconds " << metrics.retention_step_max_us << "\n"
+            << "messenger_log_syncs_total " << metrics.log_syncs << "\n"
+            << "messenger_log_segments_created_total " << metrics.log_segments_created << "\n"
+            << "messenger_messages_throttled_total{scope=\"user\"} " << metrics.throttled_user << "\n"
+            << "messenger_messages_throttled_total{scope=\"room\"} " << metrics.throttled_room << "\n"
+            << "messenger_timers_pending " << metrics.timers_pending << "\n"
+            << "messenger_idle_timeouts_total " << metrics.idle_timeouts << "\n"
+            << "messenger_keepalive_pings_total " << metrics.keepalive_pings << "\n"
+            << "messenger_sessions_shed_total " << metrics.sessions_shed << "\n"
+            << "messenger_resident_memory_bytes " << metrics.resident_bytes << "\n"
+            << "messenger_tls_handshakes_total " << metrics.tls_handshakes << "\n"
+            << "messenger_tls_resumed_total " << metrics.tls_resumed << "\n"
+            << "messenger_tls_handshake_errors_total " << metrics.tls_handshake_errors << "\n"
+            << "messenger_arena_heap_allocations_total " << metrics.arena_heap_allocations << "\n"
+            << "messenger_arena_recycled_blocks_total " << metrics.arena_recycled_blocks << "\n"
+            << "messenger_arena_cached_bytes " << metrics.arena_cached_bytes << "\n"
+            << "messenger_read_buffer_bytes_in_use " << metrics.read_buffer_bytes_in_use << "\n"
+            << "messenger_read_buffer_cached_bytes " << metrics.read_buffer_cached_bytes << "\n";
+        return make_response(req, http::status::ok, out.str(), "text/plain; version=0.0.4");
+        });
+    // GET /api/history?limit=50&before=<id> - последние сообщения, новые первыми
+    router.add(http::verb::get, "/api/history", [](const http_request& req) {
+        auto before = query_param(req.target(), "before");
+        return messages_json(req, store->history(before ? std::atoll(before->c_str()) : INT64_MAX, limit_param(req, 50)));
+        });
+    // GET /api/files?id=<id> - вложение из сообщения type='file', с поддержкой Range
+    router.add(http::verb::get, "/api/files", [](const http_request& req) -> http_reply {
+        auto id = query_param(req.target(), "id");
+        if (!id || id->empty()) {
+            return make_response(req, http::status::bad_request, "Missing id\n");
+        }
+        auto m = store->get(std::atoll(id->c_str()));
+        if (!m || m->type != "file" || !m->recipient.empty()) {
+            m.reset();
+        }
+        std::error_code ec;
+        auto size = !m || m->file_path.empty() ? 0 : std::filesystem::file_size(m->file_path, ec);
+        if (!m || m->file_path.empty() || ec) {
+            return make_response(req, http::status::not_found, "Not found\n");
+        }
+        http_reply reply = make_response(req, http::status::ok, "", "application/octet-stream");
+        reply.response.set(http::field::content_disposition, "attachment; filename=\"" + m->content + "\"");
+        // Вложение не меняется, пока существует сообщение
+        reply.response.set(http::field::cache_control, "private, max-age=86400");
+        set_file_body(req, reply, m->file_path, size);
+        return reply;
+        });
+    // GET /api/search?q=<text>&limit=50 - поиск по тексту сообщений
+    router.add(http::verb::get, "/api/search", [](const http_request& req) {
+        constexpr std::size_t max_query = 256;
+        auto q = query_param(req.target(), "q");
+        if (!q || q->empty()) {
+            return make_response(req, http::status::bad_request, "Missing q\n");
+        }
+        if (q->size() > max_query) {
+            return make_response(req, http::status::bad_request, "q is too long\n");
+        }
+        return messages_json(req, store->search(*q, limit_param(req, 50)));
+        });
+}
+
+std::shared_ptr<listener> do_listen(net::io_context& ioc, tcp::endpoint endpoint, sqlite3* db,
+    const char* handoff_env = "MESSENGER_LISTEN_FD") {
     std::cout << "Listening for connections on " << endpoint << "..." << std::endl;
-    auto l = std::make_shared<listener>(ioc, endpoint, db);
+    std::shared_ptr<listener> l;
+#ifndef _WIN32
+    // Горячий перезапуск: сокет передан старым процессом через окружение
+    if (const char* fd = std::getenv(handoff_env)) {
+        l = std::make_shared<listener>(ioc, endpoint, std::atoi(fd), db);
+        unsetenv(handoff_env);
+    }
+#endif
+    if (!l) {
+        l = std::make_shared<listener>(ioc, endpoint, db);
+    }
+    l->set_handoff_env(handoff_env);
     l->start();
+    return l;
+}
+
+// Сообщения уходят в хранилище в save_message; хвост журнала
+// дописывается на диск после ioc.run(), здесь ждём только закрытия сессий
+void check_drained(net::io_context& ioc) {
+    if (live_sessions.empty()) {
+        std::cout << "Drain complete" << std::endl;
+        ioc.stop();
+        return;
+    }
+    timers.schedule(std::chrono::milliseconds(100), [&ioc]() {
+        check_drained(ioc);
+        });
+}
+
+// Плавная остановка: прекращаем accept, каждая сессия дописывает очередь
+// и закрывается с кодом 1012. Сессии закрываются равномерно в течение
+// spread, чтобы клиенты не переподключались одной волной.
+void begin_drain(net::io_context& ioc, const std::vector<std::shared_ptr<listener>>& listeners,
+    std::chrono::milliseconds spread = std::chrono::seconds(5),
+    std::chrono::milliseconds deadline = std::chrono::seconds(15)) {
+    if (draining) {
+        return;
+    }
+    draining = true;
+    std::cout << "Draining " << live_sessions.size() << " sessions..." << std::endl;
+    for (const auto& l : listeners) {
+        l->stop();
+    }
+    std::size_t index = 0;
+    std::size_t count = live_sessions.size();
+    for (session* s : live_sessions) {
+        s->drain(spread * index++ / count);
+    }
+    check_drained(ioc);
+    timers.schedule(deadline, [&ioc]() {
+        std::cerr << "Drain deadline reached, " << live_sessions.size() << " sessions left" << std::endl;
+        ioc.stop();
+        });
+}
+
+#ifdef MESSENGER_ENABLE_TLS
+// TLS 1.3 с возобновлением сессий: OpenSSL выдаёт клиенту session tickets,
+// и повторное подключение обходится без полного рукопожатия. Ключи тикетов
+// живут в памяти процесса, после перезапуска клиенты рукопожимаются заново.
+std::unique_ptr<net::ssl::context> make_tls_context(const std::string& cert, const std::string& key) {
+    auto ctx = std::make_unique<net::ssl::context>(net::ssl::context::tls_server);
+    SSL_CTX* native = ctx->native_handle();
+    SSL_CTX_set_min_proto_version(native, TLS1_3_VERSION);
+    ctx->set_options(net::ssl::context::default_workarounds | net::ssl::context::no_compression);
+    SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_num_tickets(native, 2);
+    static const unsigned char session_id_context[] = "messenger";
+    SSL_CTX_set_session_id_context(native, session_id_context, sizeof(session_id_context) - 1);
+    beast::error_code ec;
+    ctx->use_certificate_chain_file(cert, ec);
+    if (!ec) {
+        ctx->use_private_key_file(key, net::ssl::context::pem, ec);
+    }
+    if (ec) {
+        std::cerr << "TLS disabled: cannot load " << cert << " / " << key << ": " << ec.message() << std::endl;
+        return nullptr;
+    }
+    return ctx;
+}
+#endif
+
+#ifndef _WIN32
+// Передача слушающих сокетов новому процессу (тот же бинарник, те же
+// аргументы). Новый процесс сразу начинает принимать соединения, а этот
+// уходит в плавную остановку - порт не закрывается ни на миг.
+bool hand_off(const std::vector<std::shared_ptr<listener>>& listeners, char* argv[]) {
+    std::vector<std::pair<int, int>> fds; // дескриптор и его исходные флаги
+    for (const auto& l : listeners) {
+        int fd = l->native_handle();
+        int flags = ::fcntl(fd, F_GETFD);
+        if (flags < 0 || ::fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC) < 0) {
+            std::cerr << "Hand-off failed: cannot clear FD_CLOEXEC" << std::endl;
+            for (auto [restored, old_flags] : fds) {
+                ::fcntl(restored, F_SETFD, old_flags);
+            }
+            return false;
+        }
+        fds.emplace_back(fd, flags);
+    }
+    pid_t pid = ::fork();
+    if (pid < 0) {
+        std::cerr << "Hand-off failed: fork error " << errno << std::endl;
+        for (auto [fd, flags] : fds) {
+            ::fcntl(fd, F_SETFD, flags);
+        }
+        return false;
+    }
+    if (pid == 0) {
+        // Дочерний процесс не должен держать клиентские сокеты и базу
+        long max_fd = ::sysconf(_SC_OPEN_MAX);
+        for (int i = 3; i < (max_fd > 0 ? max_fd : 1024); ++i) {
+            bool inherited = std::any_of(fds.begin(), fds.end(), [i](const auto& p) { return p.first == i; });
+            if (!inherited) {
+                ::close(i);
+            }
+        }
+        for (std::size_t i = 0; i < listeners.size(); ++i) {
+            ::setenv(listeners[i]->handoff_env(), std::to_string(fds[i].first).c_str(), 1);
+        }
+        ::execvp(argv[0], argv);
+        _exit(127);
+    }
+    for (auto [fd, flags] : fds) {
+        ::fcntl(fd, F_SETFD, flags);
+    }
+    std::cout << "Listening socket handed off to process " << pid << std::endl;
+    return true;
+}
+#endif
+
+bool exec_sql(sqlite3* db, const char* sql, const char* what) {
+    char* errMsg = 0;
+    if (sqlite3_exec(db, sql, 0, 0, &errMsg) != SQLITE_OK) {
+        std::cerr << "SQL error (" << what << "): " << errMsg << std::endl;
+        sqlite3_free(errMsg);
+        return false;
+    }
+    return true;
+}
+
+// Схема основной базы. Версия хранится в PRAGMA user_version, при запуске
+// применяются только миграции новее неё. Каждая миграция идемпотентна
+// (IF NOT EXISTS, проверка столбца), поэтому и база без версии, созданная
+// до появления миграций, проходит их без ошибок. Все миграции выполняются
+// до открытия порта и по частям не делятся: VACUUM и CREATE INDEX в SQLite -
+// одна транзакция, которая держит блокировку записи всё время построения, и
+// запись из цикла событий ждала бы её. На большой базе миграции 1, 6 и 7
+// задерживают запуск: перед ними в лог пишется размер таблицы, после - время.
+class schema_migrations {
+public:
+    struct migration {
+        int version;
+        const char* name;
+        std::function<bool(sqlite3*)> apply;
+    };
+
+    schema_migrations() {
+        add(1, "incremental auto_vacuum", [](sqlite3* db) {
+            // Режим auto_vacuum меняется только вместе с VACUUM. Базы без версии могли
+            // уже перейти на него раньше - тогда полный VACUUM перед открытием порта не нужен.
+            sqlite3_stmt* mode;
+            if (sqlite3_prepare_v2(db, "PRAGMA auto_vacuum;", -1, &mode, nullptr) == SQLITE_OK) {
+                bool incremental = sqlite3_step(mode) == SQLITE_ROW && sqlite3_column_int(mode, 0) == 2;
+                sqlite3_finalize(mode);
+                if (incremental) {
+                    return true;
+                }
+            }
+            announce(db, "Switching database to incremental auto_vacuum (VACUUM)");
+            return exec_sql(db, "PRAGMA auto_vacuum = INCREMENTAL; VACUUM;", "auto_vacuum");
+            });
+        add(2, "users and messages", [](sqlite3* db) {
+            return exec_sql(db, "CREATE TABLE IF NOT EXISTS users ("
+                "login TEXT PRIMARY KEY NOT NULL, "
+                "password TEXT NOT NULL);"
+                "CREATE TABLE IF NOT EXISTS messages ("
+                "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+                "user TEXT NOT NULL, "
+                "content TEXT, "
+                "type TEXT NOT NULL, "
+                "file_path TEXT, "
+                "timestamp DATETIME DEFAULT CURRENT_TIMESTAMP, "
+                "recipient TEXT);", "messages");
+            });
+        add(3, "messages.recipient", [](sqlite3* db) {
+            // recipient (личные сообщения) добавлен позже: старой базе - ALTER TABLE
+            sqlite3_stmt* probe;
+            if (sqlite3_prepare_v2(db, "SELECT recipient FROM messages LIMIT 0;", -1, &probe, nullptr) == SQLITE_OK) {
+                sqlite3_finalize(probe);
+                return true;
+            }
+            return exec_sql(db, "ALTER TABLE messages ADD COLUMN recipient TEXT;", "messages.recipient");
+            });
+        add(4, "read_marks", [](sqlite3* db) {
+            return exec_sql(db, "CREATE TABLE IF NOT EXISTS read_marks ("
+                "user TEXT NOT NULL, "
+                "room TEXT NOT NULL, "
+                "last_read INTEGER NOT NULL, "
+                "PRIMARY KEY (user, room)) WITHOUT ROWID;", "read_marks");
+            });
+        add(5, "blobs", [](sqlite3* db) {
+            return exec_sql(db, "CREATE TABLE IF NOT EXISTS blobs ("
+                "hash TEXT PRIMARY KEY NOT NULL, "
+                "size INTEGER NOT NULL, "
+                "refs INTEGER NOT NULL) WITHOUT ROWID;", "blobs");
+            });
+        add(6, "idx_messages_dm", [](sqlite3* db) {
+            announce(db, "Building idx_messages_dm");
+            return exec_sql(db, "CREATE INDEX IF NOT EXISTS idx_messages_dm ON messages (user, recipient, id);", "idx_messages_dm");
+            });
+        add(7, "idx_messages_inbox", [](sqlite3* db) {
+            // Входящие личные по отправителям - для подсчёта непрочитанного
+            announce(db, "Building idx_messages_inbox");
+            return exec_sql(db, "CREATE INDEX IF NOT EXISTS idx_messages_inbox ON messages (recipient, user);", "idx_messages_inbox");
+            });
+    }
+
+    // false - запускаться нельзя
+    bool apply_pending(sqlite3* db) {
+        int version = user_version(db);
+        for (const auto& m : migrations_) {
+            if (m.version > version && !apply(db, m)) {
+                return false;
+            }
+        }
+        std::cout << "Schema version " << user_version(db) << std::endl;
+        return true;
+    }
+
+private:
+    void add(int version, const char* name, std::function<bool(sqlite3*)> apply) {
+        migrations_.push_back({ version, name, std::move(apply) });
+    }
+
+    // Долгий шаг - заранее в лог, чтобы закрытый порт не выглядел зависанием
+    static void announce(sqlite3* db, const char* what) {
+        std::int64_t rows = 0;
+        sqlite3_stmt* stmt;
+        // MAX(id) - по первичному ключу, без прохода по таблице
+        if (sqlite3_prepare_v2(db, "SELECT MAX(id) FROM messages;", -1, &stmt, nullptr) == SQLITE_OK) {
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                rows = sqlite3_column_int64(stmt, 0);
+            }
+            sqlite3_finalize(stmt);
+        }
+        if (rows > 0) {
+            std::cout << what << " over about " << rows << " messages; the port opens after it finishes" << std::endl;
+        }
+    }
+
+    static int user_version(sqlite3* db) {
+        int version = 0;
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, nullptr) == SQLITE_OK) {
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                version = sqlite3_column_int(stmt, 0);
+            }
+            sqlite3_finalize(stmt);
+        }
+        return version;
+    }
+
+    static bool apply(sqlite3* db, const migration& m) {
+        auto begin = std::chrono::steady_clock::now();
+        if (!m.apply(db)) {
+            std::cerr << "Migration " << m.version << " (" << m.name << ") failed" << std::endl;
+            return false;
+        }
+        std::string bump = "PRAGMA user_version = " + std::to_string(m.version) + ";";
+        if (!exec_sql(db, bump.c_str(), "user_version")) {
+            return false;
+        }
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count();
+        std::cout << "Migration " << m.version << " (" << m.name << ") applied in " << ms << " ms" << std::endl;
+        return true;
+    }
+
+    std::vector<migration> migrations_;
+};
+
+// Настройки, которые меняются на ходу: при запуске и по SIGHUP
+void apply_tunables(sqlite3* db) {
+    sqlite3_busy_timeout(db, static_cast<int>(config.db_busy_timeout.count()));
+    std::string pragmas = "PRAGMA synchronous = " + config.db_synchronous
+        + "; PRAGMA cache_size = -" + std::to_string(config.db_cache_kib) + ";";
+    exec_sql(db, pragmas.c_str(), "pragmas");
+    admission.set_limits(config.admission);
+    limiter.set_limits(config.messages);
+    retention_policy policy;
+    policy.max_age = std::chrono::hours(24) * config.retention_days;
+    policy.max_rows = config.retention_max_rows;
+    retention.start(policy);
 }
 
-int main() {
+int main(int argc, char* argv[]) {
     try {
-        std::cout << "Server starting on port 8080..." << std::endl;
+        config_loader loader(argc, argv);
+        if (!loader.load(config)) {
+            return 1;
+        }
+        std::cout << "Server starting on port " << config.port << "..." << std::endl;
+        // Движок хранилища: sqlite (по умолчанию), log - сегментный журнал сообщений,
+        // memory - всё в памяти, null - ничего не хранится. Для memory и null база
+        // (отметки о прочтении, вложения) тоже открывается в памяти: ноль дискового I/O.
+        const std::string& engine = config.storage;
+        if (engine != "sqlite" && engine != "log" && engine != "memory" && engine != "null" && engine != "sharded") {
+            std::cerr << "Unknown storage engine: " << engine << std::endl;
+            return 1;
+        }
+        bool in_memory = engine == "memory" || engine == "null";
         sqlite3* db;
-        int rc = sqlite3_open("F:\\Projects\\Messenger\\messenger.db", &db);
+        int rc = sqlite3_open(in_memory ? ":memory:" : config.db_path.c_str(), &db);
         if (rc) {
             std::cerr << "Cannot open database: " << sqlite3_errmsg(db) << std::endl;
             return 1;
         }
         std::cout << "Database opened successfully!" << std::endl;
-
-        const char* sql = "CREATE TABLE IF NOT EXISTS users ("
-            "login TEXT PRIMARY KEY NOT NULL, "
-            "password TEXT NOT NULL);";
-        char* errMsg = 0;
-        rc = sqlite3_exec(db, sql, 0, 0, &errMsg);
-        if (rc != SQLITE_OK) {
-            std::cerr << "SQL error: " << errMsg << std::endl;
-            sqlite3_free(errMsg);
-            sqlite3_close(db);
-            return 1;
+        // Старый процесс при передаче сокета (SIGUSR2) ещё пишет в базу - ждём, а не падаем
+        sqlite3_busy_timeout(db, static_cast<int>(config.db_busy_timeout.count()));
+        if (!in_memory) {
+            std::string journal = "PRAGMA journal_mode = " + config.db_journal_mode + ";";
+            exec_sql(db, journal.c_str(), "journal_mode");
         }
-        std::cout << "Table 'users' created successfully!" << std::endl;
+        startup.phase("open database");
 
-        const char* sql_messages = "CREATE TABLE IF NOT EXISTS messages ("
-            "id INTEGER PRIMARY KEY AUTOINCREMENT, "
-            "user TEXT NOT NULL, "
-            "content TEXT, "
-            "type TEXT NOT NULL, "
-            "file_path TEXT, "
-            "timestamp DATETIME DEFAULT CURRENT_TIMESTAMP);";
-        rc = sqlite3_exec(db, sql_messages, 0, 0, &errMsg);
-        if (rc != SQLITE_OK) {
-            std::cerr << "SQL error (messages): " << errMsg << std::endl;
-            sqlite3_free(errMsg);
+        schema_migrations schema;
+        if (!schema.apply_pending(db)) {
             sqlite3_close(db);
             return 1;
         }
-        std::cout << "Table 'messages' created successfully!" << std::endl;
+        receipts.start(db);
+        blobs.start(db);
+        startup.phase("schema");
 
+        assets.load(config.web_root);
+        startup.phase("static assets");
+        std::error_code dir_ec;
+        std::filesystem::create_directories(config.upload_dir, dir_ec);
+        if (dir_ec) {
+            std::cerr << "Cannot create " << config.upload_dir << ": " << dir_ec.message() << std::endl;
+        }
+        if (engine == "memory") {
+            accounts = std::make_unique<memory_user_store>();
+            store = std::make_unique<memory_message_store>();
+        }
+        else if (engine == "null") {
+            accounts = std::make_unique<null_user_store>();
+            store = std::make_unique<null_message_store>();
+        }
+        else if (engine == "sharded") {
+            // shards файлов <shard_prefix><n>.db; уменьшать число нельзя - лишние шарды не читаются
+            std::size_t shard_count = std::clamp<std::size_t>(config.shards, 1, 64);
+            accounts = std::make_unique<sqlite_user_store>(db);
+            auto sharded = std::make_unique<sharded_message_store>();
+            sqlite_message_store legacy(db);
+            if (!sharded->open(config.shard_prefix, shard_count, legacy)) {
+                sqlite3_close(db);
+                return 1;
+            }
+            store = std::move(sharded);
+        }
+        else if (engine == "log") {
+            accounts = std::make_unique<sqlite_user_store>(db);
+            auto log = std::make_unique<segment_log_store>(config.log_dir);
+            if (!log->open()) {
+                sqlite3_close(db);
+                return 1;
+            }
+            store = std::move(log);
+        }
+        else {
+            accounts = std::make_unique<sqlite_user_store>(db);
+            store = std::make_unique<sqlite_message_store>(db);
+        }
+        // archive_days: старые сообщения уезжают из messages в сжатый архив
+        tiered_message_store* tiers = nullptr;
+        if (config.archive_days > 0) {
+            if (engine != "sqlite") {
+                std::cerr << "Archive tier needs the sqlite engine, ignoring archive_days" << std::endl;
+            }
+            else {
+                auto cold = std::make_unique<archive_tier>();
+                if (!cold->open(config.archive_dir)) {
+                    sqlite3_close(db);
+                    return 1;
+                }
+                auto tiered = std::make_unique<tiered_message_store>(std::move(store), std::move(cold));
+                tiers = tiered.get();
+                store = std::move(tiered);
+            }
+        }
+        receipts.note_message(store->latest_id());
+        std::cout << "Message storage: " << store->name() << std::endl;
+        startup.phase("message storage");
+        if (auto collected = blobs.collect()) {
+            std::cout << "Removed " << collected << " unreferenced attachments" << std::endl;
+        }
+        startup.phase("attachments");
+        register_routes();
         net::io_context ioc{ 1 };
-        tcp::endpoint endpoint{ net::ip::make_address("0.0.0.0"), 8080 };
-        do_listen(ioc, endpoint, db);
-        std::cout << "Running io_context..." << std::endl;
+        timers.start(ioc);
+        keepalive.start();
+        // Лимиты, PRAGMA и срок хранения (retention_days, retention_max_rows; по умолчанию хранится всё)
+        apply_tunables(db);
+        if (tiers) {
+            archiver.start(tiers, std::chrono::hours(24) * config.archive_days);
+        }
+        auto address = net::ip::make_address(config.bind_address);
+        tcp::endpoint endpoint{ address, config.port };
+        std::vector<std::shared_ptr<listener>> listeners{ do_listen(ioc, endpoint, db) };
+#ifdef MESSENGER_ENABLE_TLS
+        auto tls = make_tls_context(config.tls_cert, config.tls_key);
+        if (tls) {
+            tcp::endpoint tls_endpoint{ address, config.tls_port };
+            listeners.push_back(do_listen(ioc, tls_endpoint, db, "MESSENGER_TLS_LISTEN_FD"));
+            listeners.back()->enable_tls(*tls);
+        }
+#endif
+        startup.phase("listen");
+        startup.ready();
+        // Прогрев: первая страница истории в кэше страниц SQLite до первого клиента
+        timers.schedule(std::chrono::milliseconds(1), []() {
+            auto begin = std::chrono::steady_clock::now();
+            store->history(INT64_MAX, 50);
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count();
+            std::cout << "[startup] history warmup: " << ms << " ms" << std::endl;
+            });
+
+        // SIGINT/SIGTERM - плавная остановка; SIGUSR2 - передать сокет
+        // новому процессу и остановиться; SIGHUP - перечитать настройки
+        net::signal_set signals(ioc, SIGINT, SIGTERM);
+#ifndef _WIN32
+        signals.add(SIGUSR2);
+        signals.add(SIGHUP);
+#endif
+        std::function<void(beast::error_code, int)> on_signal = [&](beast::error_code ec, int signo) {
+            if (ec) {
+                return;
+            }
+#ifndef _WIN32
+            if (signo == SIGHUP) {
+                server_config next;
+                if (loader.load(next)) {
+                    loader.reload_into(config, next);
+                    apply_tunables(db);
+                    ++metrics.config_reloads;
+                }
+                else {
+                    ++metrics.config_reload_errors;
+                    std::cerr << "Config reload failed, keeping current settings" << std::endl;
+                }
+                signals.async_wait(on_signal);
+                return;
+            }
+            if (signo == SIGUSR2 && !hand_off(listeners, argv)) {
+                signals.async_wait(on_signal);
+                return;
+            }
+#endif
+            std::cout << "Signal " << signo << " received" << std::endl;
+            begin_drain(ioc, listeners);
+            };
+        signals.async_wait(on_signal);
+        std::cout << "Running io_context (" << io_backend << ")..." << std::endl;
         ioc.run();
+        receipts.flush();
+        store->sync();
+        timers.stop();
+        clients.clear();
+        store.reset();
+        accounts.reset();
         sqlite3_close(db);
     }
     catch (const std::exception& e) {